@@ -35,11 +35,50 @@
 */
 
 #include <iostream>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <bitset>
+#include <array>
 using namespace std;
 
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
 
+// Pick the widest SIMD the compiler is targeting for the light accumulation and ray casts
+#if defined(__AVX2__)
+	#define SC_SIMD_AVX2
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SC_SIMD_SSE2
+	#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+// For mapping tile-map files into memory
+#if defined(_WIN32)
+	#if !defined(NOMINMAX)
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
 /* 
 Data structure for the edges.
 Instead of analyzing each block individually 
@@ -70,442 +109,4243 @@ struct sCell {
 #define EAST 2
 #define WEST 3
 
-class ShadowCasting : public olc::PixelGameEngine {
+/*
+An edge endpoint as seen from the light source, used by the
+angular sweep. Each edge produces one event where the sweep
+starts seeing it and one where it stops seeing it.
+*/
+struct sSweepEvent {
+	float angle;
+	float x, y;
+	int edge_id;
+	bool begin;
+};
+
+/*
+What a light's visibility polygon was last worked out from, so it can be
+kept as it is while the light stays put and the PolyMap is unchanged. The
+position is quantized to a grid of fVisibilityCacheStep pixels.
+*/
+struct sVisibilityCache {
+	bool bValid = false;
+	int nKeyX = 0, nKeyY = 0;
+	float radius = 0.0f;
+	uint32_t nGeneration = 0, nSettings = 0;
+};
+
+/*
+The different ways of building the visibility polygon.
+They produce the same polygon, so they can be swapped at runtime.
+*/
+enum VisibilityEngine {
+	VIS_BRUTE_FORCE,	// 3 rays per edge endpoint tested against every edge, O(E^2)
+	VIS_ANGULAR_SWEEP,	// Endpoints sorted by angle, active edges ordered by distance, O(E log E)
+	VIS_EDGE_GRID,		// Same rays as brute force, but each only tests the edges in the grid buckets it crosses
+	VIS_ENGINE_COUNT
+};
+
+const char *VisibilityEngineNames[VIS_ENGINE_COUNT] = { "Brute Force", "Angular Sweep", "Edge Grid" };
+
+/*
+Every heap allocation made by the program, so the benchmark can report
+how many each stage makes. Over-aligned ones are left to the library.
+Only counted once the benchmark has set bCountAllocations, before it
+starts any threads, so the app and headless runs don't pay for it.
+*/
+atomic<size_t> nHeapAllocations(0);
+bool bCountAllocations = false;
+
+void *operator new(size_t size) {
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	if (bCountAllocations)
+		nHeapAllocations.fetch_add(1, memory_order_relaxed);
+	return p;
+}
+
+// Kept out of line: GCC flags a free() inlined against a new it didn't inline
+#if defined(__GNUC__)
+	#define ALLOC_NOINLINE __attribute__((noinline))
+#else
+	#define ALLOC_NOINLINE
+#endif
+
+ALLOC_NOINLINE void operator delete(void *p) noexcept { free(p); }
+ALLOC_NOINLINE void operator delete(void *p, size_t) noexcept { free(p); }
+
+/*
+A point light, as passed to the batched visibility API.
+*/
+struct sLight {
+	float x, y;
+	float radius;
+	olc::Pixel colour = olc::WHITE;
+	float size = 0.0f;	// Radius of the disc giving off the light, 0 for a point
+};
+
+/*
+A segment between two points, as passed to the batched line of sight API.
+*/
+struct sSightLine {
+	float ax, ay;
+	float bx, by;
+};
+
+/*
+A small pool of worker threads for ParallelFor. The items are dealt out
+in equal slices, one per thread. A thread that runs out of work steals
+from the front of the other slices, so a few expensive items can't leave
+the rest of the pool idle. The calling thread works as thread 0.
+*/
+class ThreadPool {
 public:
-    ShadowCasting() {
-        sAppName = "ShadowCasting";
-    }
+	~ThreadPool() {
+		SetThreadCount(1);
+	}
 
-private: 
-	// Defining the array for the world and the size of it
-	sCell *world;
-	int nWorldWidth = 40;
-	int nWorldHeight = 30;
+	int ThreadCount() const {
+		return (int)vecWorkers.size() + 1;
+	}
 
+	void SetThreadCount(int nThreads) {
+		nThreads = max(1, nThreads);
+		if (nThreads == ThreadCount())
+			return;
 
-	olc::Sprite *sprLightCast;
-	olc::Sprite *buffLightRay;
-	olc::Sprite *buffLightTex;
+		// Stop the current workers before starting the new ones
+		{
+			unique_lock<mutex> lock(mux);
+			bStop = true;
+		}
+		cvWork.notify_all();
+		for (auto &worker : vecWorkers)
+			worker.join();
+		vecWorkers.clear();
 
-	// Define the vector for the pool of edges
-	vector<sEdge> vecEdges;
+		bStop = false;
+		slices.reset(new sSlice[nThreads]);
+		for (int t = 1; t < nThreads; t++)
+			vecWorkers.emplace_back(&ThreadPool::WorkerThread, this, t, nGeneration);
+	}
 
+	// Call job(item, thread) for every item in [0, nItems), returning once they are all done
+	void ParallelFor(int nItems, const function<void(int, int)> &job) {
+		int nThreads = ThreadCount();
+		if (nThreads == 1)
+		{
+			for (int i = 0; i < nItems; i++)
+				job(i, 0);
+			return;
+		}
 
-	vector<tuple<float, float, float>> vecVisibilityPolygonPoints;
+		for (int t = 0; t < nThreads; t++)
+		{
+			slices[t].next = nItems * t / nThreads;
+			slices[t].end = nItems * (t + 1) / nThreads;
+		}
 
-	void ConvertTileMapToPolyMap(int startX, int startY, int inputWidth, int inputHeigth, float fBlockWidth, int pitch) {
-		// Clear "PolyMap"
-		vecEdges.clear();
+		{
+			unique_lock<mutex> lock(mux);
+			pJob = &job;
+			nBusy = nThreads - 1;
+			nGeneration++;
+		}
+		cvWork.notify_all();
 
-		for (int x = 0; x < inputWidth; x++)
-			for (int y = 0; y < inputHeigth; y++)
-				for (int j = 0; j < 4; j++)
-				{
-					world[(y + startY) * pitch + (x + startX)].edge_exist[j] = false;
-					world[(y + startY) * pitch + (x + startX)].edge_id[j] = 0;
-				}
+		RunSlices(0);
 
-		// Iterate through region from top left to bottom right
-		for (int x = 1; x < inputWidth - 1; x++)
-			for (int y = 1; y < inputHeigth - 1; y++)
+		unique_lock<mutex> lock(mux);
+		cvDone.wait(lock, [&] { return nBusy == 0; });
+		pJob = nullptr;
+	}
+
+private:
+	// Each slice on its own cache line, as every thread hammers its own counter
+	struct alignas(64) sSlice {
+		atomic<int> next;
+		int end;
+	};
+
+	void RunSlices(int nThread) {
+		int nThreads = ThreadCount();
+		for (int k = 0; k < nThreads; k++)
+		{
+			sSlice &slice = slices[(nThread + k) % nThreads];
+			for (int i = slice.next++; i < slice.end; i = slice.next++)
+				(*pJob)(i, nThread);
+		}
+	}
+
+	void WorkerThread(int nThread, int nSeen) {
+		while (true)
+		{
 			{
-				// Create some convenient indices
-				int i = (y + startY) * pitch + (x + startX);		// This
-				int n = (y + startY - 1) * pitch + (x + startX);	// Northern Neighbour
-				int s = (y + startY + 1) * pitch + (x + startX);	// Southern Neighbour
-				int w = (y + startY) * pitch + (x + startX - 1);	// Western Neighbour
-				int e = (y + startY) * pitch + (x + startX + 1);	// Eastern Neighbour
+				unique_lock<mutex> lock(mux);
+				cvWork.wait(lock, [&] { return bStop || nGeneration != nSeen; });
+				if (bStop)
+					return;
+				nSeen = nGeneration;
+			}
 
-				// If this cell exists, check if it needs edges
-				if (world[i].exist)
-				{
-					// If this cell has no western neighbour, it needs a western edge
-					if (!world[w].exist)
-					{
-						// It can either extend it from its northern neighbour if they have
-						// one, or It can start a new one.
-						if (world[n].edge_exist[WEST])
-						{
-							// Northern neighbour has a western edge, so grow it downwards
-							vecEdges[world[n].edge_id[WEST]].endY += fBlockWidth;
-							world[i].edge_id[WEST] = world[n].edge_id[WEST];
-							world[i].edge_exist[WEST] = true;
-						}
-						else
-						{
-							// Northern neighbour does not have one, so create one
-							sEdge edge;
-							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
-							edge.endX = edge.startX; edge.endY = edge.startY + fBlockWidth;
+			RunSlices(nThread);
 
-							// Add edge to Polygon Pool
-							int edge_id = vecEdges.size();
-							vecEdges.push_back(edge);
+			unique_lock<mutex> lock(mux);
+			if (--nBusy == 0)
+				cvDone.notify_one();
+		}
+	}
 
-							// Update tile information with edge information
-							world[i].edge_id[WEST] = edge_id;
-							world[i].edge_exist[WEST] = true;
-						}
-					}
+	vector<thread> vecWorkers;
+	unique_ptr<sSlice[]> slices = unique_ptr<sSlice[]>(new sSlice[1]);
+	const function<void(int, int)> *pJob = nullptr;
 
-					// If this cell dont have an eastern neignbour, It needs a eastern edge
-					if (!world[e].exist)
-					{
-						// It can either extend it from its northern neighbour if they have
-						// one, or It can start a new one.
-						if (world[n].edge_exist[EAST])
-						{
-							// Northern neighbour has one, so grow it downwards
-							vecEdges[world[n].edge_id[EAST]].endY += fBlockWidth;
-							world[i].edge_id[EAST] = world[n].edge_id[EAST];
-							world[i].edge_exist[EAST] = true;
-						}
-						else
-						{
-							// Northern neighbour does not have one, so create one
-							sEdge edge;
-							edge.startX = (startX + x + 1) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
-							edge.endX = edge.startX; edge.endY = edge.startY + fBlockWidth;
+	mutex mux;
+	condition_variable cvWork;
+	condition_variable cvDone;
+	int nGeneration = 0;
+	int nBusy = 0;
+	bool bStop = false;
+};
 
-							// Add edge to Polygon Pool
-							int edge_id = vecEdges.size();
-							vecEdges.push_back(edge);
+/*
+The parts of a frame timed by the FrameProfiler.
+*/
+enum ProfileStage {
+	PROF_FRAME,			// The whole of OnUserUpdate
+	PROF_POLYMAP,		// Edge extraction after a click
+	PROF_VISIBILITY,	// Visibility polygons of every light
+	PROF_BAKE,			// Baking the placed lights into the lightmap
+	PROF_DEDUP,			// RemoveDuplicatePoints
+	PROF_FANS,			// Light mask fans, each light added into the accumulator
+	PROF_COMPOSITE,		// Starting the accumulator, and the tone mapped composite
+	PROF_TILES,			// Drawing the blocks, and the fog of war over them
+	PROF_STAGE_COUNT
+};
+
+const char *ProfileStageNames[PROF_STAGE_COUNT] = { "Frame", "PolyMap", "Visibility", "Bake", "Dedup", "Fans", "Composite", "Tiles" };
+
+/*
+Times the stages of the last nHistory frames with steady_clock. Call
+BeginFrame at the start of each frame, then wrap each stage in a Scope.
+A stage timed more than once in a frame adds up. Frames are kept in a
+ring, so nothing allocates once it is running.
+*/
+class FrameProfiler {
+public:
+	static const int nHistory = 256;
+
+	struct sStats {
+		double min, avg, p99;	// Microseconds, over the frames that ran the stage
+		int frames;
+	};
+
+	// Times a stage from construction to destruction
+	class Scope {
+	public:
+		Scope(FrameProfiler &profiler, ProfileStage stage) : profiler(profiler), stage(stage), tStart(profiler.Now()) {}
+		~Scope() { profiler.Add(stage, tStart, profiler.Now()); }
+
+	private:
+		FrameProfiler &profiler;
+		ProfileStage stage;
+		int64_t tStart;
+	};
+
+	FrameProfiler() : tEpoch(chrono::steady_clock::now()), frames(nHistory) {
+		vecScratch.reserve(nHistory);
+	}
+
+	Scope Time(ProfileStage stage) {
+		return Scope(*this, stage);
+	}
+
+	void BeginFrame() {
+		nFrame++;
+		sFrame &frame = frames[nFrame % nHistory];
+		frame = sFrame();
+		frame.nFrame = nFrame;
+	}
+
+	sStats Stats(ProfileStage stage) {
+		vecScratch.clear();
+		for (auto &frame : frames)
+			if (frame.nFrame > 0 && frame.bRan[stage])
+				vecScratch.push_back(frame.duration[stage] / 1000.0);
+
+		sStats stats = { 0.0, 0.0, 0.0, (int)vecScratch.size() };
+		if (vecScratch.empty())
+			return stats;
+
+		stats.min = *min_element(vecScratch.begin(), vecScratch.end());
+		for (double t : vecScratch)
+			stats.avg += t;
+		stats.avg /= vecScratch.size();
+		size_t n99 = min(vecScratch.size() - 1, vecScratch.size() * 99 / 100);
+		nth_element(vecScratch.begin(), vecScratch.begin() + n99, vecScratch.end());
+		stats.p99 = vecScratch[n99];
+		return stats;
+	}
+
+	// One row per stage per frame kept, oldest first
+	bool DumpCsv(const string &sFile) {
+		ofstream file(sFile);
+		file << fixed << setprecision(3);	// To the nanosecond, however long it has run
+		file << "frame,stage,start_us,duration_us\n";
+		ForEachRecord([&](const sFrame &frame, int s)
+		{
+			file << frame.nFrame << "," << ProfileStageNames[s] << "," << frame.start[s] / 1000.0 << "," << frame.duration[s] / 1000.0 << "\n";
+		});
+		return (bool)file;
+	}
+
+	// The same in the Chrome trace event format (chrome://tracing, Perfetto)
+	bool DumpChromeTrace(const string &sFile) {
+		ofstream file(sFile);
+		file << fixed << setprecision(3);
+		file << "{\"traceEvents\":[\n";
+		bool bFirst = true;
+		ForEachRecord([&](const sFrame &frame, int s)
+		{
+			file << (bFirst ? "" : ",\n") << "{\"name\":\"" << ProfileStageNames[s] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+				<< frame.start[s] / 1000.0 << ",\"dur\":" << frame.duration[s] / 1000.0 << ",\"args\":{\"frame\":" << frame.nFrame << "}}";
+			bFirst = false;
+		});
+		file << "\n]}\n";
+		return (bool)file;
+	}
+
+	// Whether the start times DumpCsv wrote to sFile keep the order the
+	// stages of each frame started in, none rounded onto another
+	bool CheckCsvOrder(const string &sFile) {
+		ifstream file(sFile);
+		string sLine;
+		getline(file, sLine);	// The header
+
+		bool bOrdered = true;
+		uint64_t nLastFrame = 0;
+		vector<pair<int64_t, double>> vecStarts;	// Each stage's start as timed, and as read back
+		auto check = [&]
+		{
+			sort(vecStarts.begin(), vecStarts.end());
+			for (size_t i = 1; i < vecStarts.size(); i++)
+				bOrdered = bOrdered && vecStarts[i].second > vecStarts[i - 1].second;
+			vecStarts.clear();
+		};
+		ForEachRecord([&](const sFrame &frame, int s)
+		{
+			if (frame.nFrame != nLastFrame)
+				check();
+			nLastFrame = frame.nFrame;
+
+			double fStart = 0.0;
+			if (!getline(file, sLine) || sscanf(sLine.c_str(), "%*[^,],%*[^,],%lf", &fStart) != 1)
+				bOrdered = false;
+			vecStarts.push_back({ frame.start[s], fStart });
+		});
+		check();
+		return bOrdered;
+	}
+
+private:
+	struct sFrame {
+		uint64_t nFrame = 0;
+		int64_t start[PROF_STAGE_COUNT] = {};		// Nanoseconds, from Now()
+		int64_t duration[PROF_STAGE_COUNT] = {};
+		bool bRan[PROF_STAGE_COUNT] = {};
+	};
+
+	// Nanoseconds since the profiler was made
+	int64_t Now() const {
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - tEpoch).count();
+	}
+
+	void Add(ProfileStage stage, int64_t tStart, int64_t tEnd) {
+		sFrame &frame = frames[nFrame % nHistory];
+		if (!frame.bRan[stage])
+			frame.start[stage] = tStart;
+		frame.duration[stage] += tEnd - tStart;
+		frame.bRan[stage] = true;
+	}
+
+	template<typename F>
+	void ForEachRecord(F f) {
+		for (uint64_t n = nFrame < (uint64_t)nHistory ? 1 : nFrame - nHistory + 1; n <= nFrame; n++)
+		{
+			const sFrame &frame = frames[n % nHistory];
+			for (int s = 0; s < PROF_STAGE_COUNT; s++)
+				if (frame.nFrame == n && frame.bRan[s])
+					f(frame, s);
+		}
+	}
+
+	chrono::steady_clock::time_point tEpoch;
+	vector<sFrame> frames;
+	vector<double> vecScratch;
+	uint64_t nFrame = 0;
+};
+
+/*
+Additive lighting, 16 bits per channel (r, g, b, a) so any number of
+lights can overlap without clamping. AccumulateMasked adds the falloff
+pixels, each channel scaled by (tint + 1) / 256 and then by the mask's
+coverage, (mask + 1) / 256, saturating at 65535. ToneMapped brings a sum back down to 8 bits:
+unchanged up to the knee, then easing towards white with no hard clip.
+Both have a scalar version giving the same results, for other CPUs and
+for comparison. The SIMD versions work 128 bits at a time, SSE2 being
+plenty for this with AVX2 builds too.
+*/
+const float fToneKnee = 224.0f;
+const float fToneShoulder = 255.0f - fToneKnee;
+
+inline void AccumulateMaskedScalar(uint16_t *acc, const olc::Pixel *falloff, const uint8_t *mask, olc::Pixel tint, int count) {
+	const uint32_t scale[4] = { tint.r + 1u, tint.g + 1u, tint.b + 1u, tint.a + 1u };
+	for (int i = 0; i < count; i++)
+		if (mask[i] > 0)
+		{
+			const uint8_t *f = &falloff[i].r;
+			for (int c = 0; c < 4; c++)
+				acc[4 * i + c] = (uint16_t)min(65535u, acc[4 * i + c] + ((((f[c] * scale[c]) >> 8) * (mask[i] + 1u)) >> 8));
+		}
+}
+
+inline void AccumulateMasked(uint16_t *acc, const olc::Pixel *falloff, const uint8_t *mask, olc::Pixel tint, int count) {
+	int i = 0;
+
+#if defined(SC_SIMD_AVX2) || defined(SC_SIMD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i scale = _mm_set_epi16(tint.a + 1, tint.b + 1, tint.g + 1, tint.r + 1, tint.a + 1, tint.b + 1, tint.g + 1, tint.r + 1);
+	for (; i + 4 <= count; i += 4)
+	{
+		uint32_t bits;
+		memcpy(&bits, mask + i, 4);
+		if (bits == 0)
+			continue;
+
+		// Widen each byte of the mask plus one to the four channels of a pixel,
+		// 2 pixels per register. Unlit pixels scale by 1 / 256, so add nothing.
+		__m128i cover = _mm_add_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)bits), zero), one);
+		cover = _mm_unpacklo_epi16(cover, cover);
+		__m128i k[2] = { _mm_unpacklo_epi32(cover, cover), _mm_unpackhi_epi32(cover, cover) };
+
+		__m128i f = _mm_loadu_si128((const __m128i *)(falloff + i));
+		__m128i fw[2] = { _mm_unpacklo_epi8(f, zero), _mm_unpackhi_epi8(f, zero) };
+
+		for (int j = 0; j < 2; j++)
+		{
+			__m128i add = _mm_srli_epi16(_mm_mullo_epi16(fw[j], scale), 8);
+			add = _mm_srli_epi16(_mm_mullo_epi16(add, k[j]), 8);
+			__m128i *p = (__m128i *)(acc + 4 * (i + j * 2));
+			_mm_storeu_si128(p, _mm_adds_epu16(_mm_loadu_si128(p), add));
+		}
+	}
+#endif
+
+	// Whatever is left over (or everything, without SIMD)
+	AccumulateMaskedScalar(acc + 4 * i, falloff + i, mask + i, tint, count - i);
+}
+
+// Pixels with nothing in them keep their dst value
+inline void ToneMappedScalar(olc::Pixel *dst, const uint16_t *acc, int count) {
+	for (int i = 0; i < count; i++)
+	{
+		const uint16_t *a = acc + 4 * i;
+		if ((a[0] | a[1] | a[2] | a[3]) == 0)
+			continue;
+
+		uint8_t c[3];
+		for (int j = 0; j < 3; j++)
+		{
+			float x = (float)a[j];
+			float d = max(x - fToneKnee, 0.0f);
+			c[j] = (uint8_t)nearbyintf(min(x, fToneKnee) + d * fToneShoulder / (d + fToneShoulder));
+		}
+		dst[i] = olc::Pixel(c[0], c[1], c[2]);
+	}
+}
+
+inline void ToneMapped(olc::Pixel *dst, const uint16_t *acc, int count) {
+	int i = 0;
+
+#if defined(SC_SIMD_AVX2) || defined(SC_SIMD_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	const __m128 knee = _mm_set1_ps(fToneKnee);
+	const __m128 shoulder = _mm_set1_ps(fToneShoulder);
+	const __m128 none = _mm_setzero_ps();
+	const __m128i kneeWords = _mm_set1_epi16((short)fToneKnee);
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(acc + 4 * i));
+
+		// All ones for each pixel (both halves of its 64 bits) that is empty
+		__m128i empty = _mm_cmpeq_epi32(a, zero);
+		empty = _mm_and_si128(empty, _mm_shuffle_epi32(empty, _MM_SHUFFLE(2, 3, 0, 1)));
+		if (_mm_movemask_epi8(empty) == 0xFFFF)
+			continue;
+
+		// Nothing past the knee is the common case, and needs no curve at all.
+		// Alpha is left out, it's replaced anyway.
+		__m128i s;
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(a, kneeWords), zero)) | 0xC0C0) == 0xFFFF)
+			s = _mm_packus_epi16(a, zero);
+		else
+		{
+			__m128i y[2];
+			for (int j = 0; j < 2; j++)
+			{
+				__m128 x = _mm_cvtepi32_ps(j == 0 ? _mm_unpacklo_epi16(a, zero) : _mm_unpackhi_epi16(a, zero));
+				__m128 d = _mm_max_ps(_mm_sub_ps(x, knee), none);
+				x = _mm_add_ps(_mm_min_ps(x, knee), _mm_div_ps(_mm_mul_ps(d, shoulder), _mm_add_ps(d, shoulder)));
+				y[j] = _mm_cvtps_epi32(x);
+			}
+			s = _mm_packus_epi16(_mm_packs_epi32(y[0], y[1]), zero);
+		}
+		s = _mm_or_si128(s, alpha);
+
+		// One mask lane per pixel again, to keep dst where empty
+		__m128i k = _mm_shuffle_epi32(empty, _MM_SHUFFLE(3, 1, 2, 0));
+		__m128i d = _mm_loadl_epi64((const __m128i *)(dst + i));
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(k, d), _mm_andnot_si128(k, s)));
+	}
+#endif
+
+	// Whatever is left over (or everything, without SIMD)
+	ToneMappedScalar(dst + i, acc + 4 * i, count - i);
+}
+
+/*
+The edges again, as one array per field rather than one struct per edge,
+so a SIMD register can be loaded with the same field of 8 edges. The
+arrays are 32 byte aligned and padded to a multiple of 8 with zero
+length edges, which no ray can hit.
+*/
+struct sEdgeSoA {
+	int count = 0;
+	float *startX = nullptr, *startY = nullptr;
+	float *dx = nullptr, *dy = nullptr;
+
+	sEdgeSoA() = default;
+	sEdgeSoA(const sEdgeSoA &) = delete;
+	sEdgeSoA &operator=(const sEdgeSoA &) = delete;
+	sEdgeSoA(sEdgeSoA &&other) noexcept {
+		swap(count, other.count);
+		swap(startX, other.startX); swap(startY, other.startY);
+		swap(dx, other.dx); swap(dy, other.dy);
+		swap(pBlock, other.pBlock); swap(nCapacity, other.nCapacity);
+	}
+	~sEdgeSoA() {
+		Release();
+	}
+
+	void Build(const vector<sEdge> &vecEdges) {
+		int nEdges = 0;
+		for (auto &edge : vecEdges)
+			if (edge.startX != edge.endX || edge.startY != edge.endY)
+				nEdges++;
+
+		int nPadded = (nEdges + 7) & ~7;
+		if (nPadded > nCapacity)
+		{
+			int nNewCapacity = max(nPadded, nCapacity * 2);
+			Release();
+			nCapacity = nNewCapacity;
+			pBlock = (float *)::operator new(4 * nCapacity * sizeof(float), align_val_t(32));
+			startX = pBlock;
+			startY = pBlock + nCapacity;
+			dx = pBlock + 2 * nCapacity;
+			dy = pBlock + 3 * nCapacity;
+		}
+
+		count = 0;
+		for (auto &edge : vecEdges)
+		{
+			// Skip free slots
+			if (edge.startX == edge.endX && edge.startY == edge.endY)
+				continue;
+
+			startX[count] = edge.startX;
+			startY[count] = edge.startY;
+			dx[count] = edge.endX - edge.startX;
+			dy[count] = edge.endY - edge.startY;
+			count++;
+		}
+		for (; count < nPadded; count++)
+			startX[count] = startY[count] = dx[count] = dy[count] = 0.0f;
+	}
+
+private:
+	void Release() {
+		if (pBlock)
+			::operator delete(pBlock, align_val_t(32));
+		pBlock = nullptr;
+		nCapacity = 0;
+	}
+
+	float *pBlock = nullptr;
+	int nCapacity = 0;
+};
+
+/*
+The edges within reach of one light, which are all its visibility is
+worked out from. They are clipped to a regular polygon with LIGHT_SIDES
+sides standing in for the light's circle, and the polygon's sides are
+added to them, so the visibility polygon never reaches past the radius.
+The endpoints and SoA copy are only filled in for the engines using them.
+*/
+#define LIGHT_SIDES 32
+
+struct sLightEdges {
+	vector<sEdge> vecEdges;
+	vector<pair<float, float>> vecEndpoints;
+	sEdgeSoA soa;
+};
+
+/*
+Nearest hit of a ray from the origin along (rdx, rdy) against the edges
+of the store, as t1 in units of the ray's length, or INFINITY for none.
+It is the same test IntersectRayEdge makes. CastRayEdges does it on 8
+edges at a time with AVX2 or 4 with SSE2, keeping a running minimum in
+each lane and reducing the lanes at the end.
+*/
+inline float CastRayEdgesScalar(const sEdgeSoA &edges, int first, float originX, float originY, float rdx, float rdy) {
+	float min_t1 = INFINITY;
+	for (int e = first; e < edges.count; e++)
+	{
+		float sdx = edges.dx[e], sdy = edges.dy[e];
+		if (fabs(sdx - rdx) > 0.0f && fabs(sdy - rdy) > 0.0f)
+		{
+			float t2 = (rdx * (edges.startY[e] - originY) + (rdy * (originX - edges.startX[e]))) / (sdx * rdy - sdy * rdx);
+			float t1 = (edges.startX[e] + sdx * t2 - originX) / rdx;
+			if (t1 > 0 && t2 >= 0 && t2 <= 1.0f && t1 < min_t1)
+				min_t1 = t1;
+		}
+	}
+	return min_t1;
+}
+
+inline float CastRayEdges(const sEdgeSoA &edges, float originX, float originY, float rdx, float rdy) {
+	int e = 0;
+	float min_t1 = INFINITY;
+
+#if defined(SC_SIMD_AVX2)
+	const __m256 ox = _mm256_set1_ps(originX), oy = _mm256_set1_ps(originY);
+	const __m256 rx = _mm256_set1_ps(rdx), ry = _mm256_set1_ps(rdy);
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), inf = _mm256_set1_ps(INFINITY);
+	__m256 vMin = inf;
+	for (; e + 8 <= edges.count; e += 8)
+	{
+		__m256 sx = _mm256_load_ps(edges.startX + e), sy = _mm256_load_ps(edges.startY + e);
+		__m256 sdx = _mm256_load_ps(edges.dx + e), sdy = _mm256_load_ps(edges.dy + e);
+
+		__m256 t2 = _mm256_div_ps(
+			_mm256_add_ps(_mm256_mul_ps(rx, _mm256_sub_ps(sy, oy)), _mm256_mul_ps(ry, _mm256_sub_ps(ox, sx))),
+			_mm256_sub_ps(_mm256_mul_ps(sdx, ry), _mm256_mul_ps(sdy, rx)));
+		__m256 t1 = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(sx, _mm256_mul_ps(sdx, t2)), ox), rx);
+
+		// Lanes that miss (or aren't tested at all) keep INFINITY
+		__m256 valid = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(sdx, rx, _CMP_NEQ_OQ), _mm256_cmp_ps(sdy, ry, _CMP_NEQ_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(t1, zero, _CMP_GT_OQ),
+				_mm256_and_ps(_mm256_cmp_ps(t2, zero, _CMP_GE_OQ), _mm256_cmp_ps(t2, one, _CMP_LE_OQ))));
+		vMin = _mm256_min_ps(vMin, _mm256_blendv_ps(inf, t1, valid));
+	}
+
+	__m128 m = _mm_min_ps(_mm256_castps256_ps128(vMin), _mm256_extractf128_ps(vMin, 1));
+	m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+	m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+	min_t1 = _mm_cvtss_f32(m);
+#elif defined(SC_SIMD_SSE2)
+	const __m128 ox = _mm_set1_ps(originX), oy = _mm_set1_ps(originY);
+	const __m128 rx = _mm_set1_ps(rdx), ry = _mm_set1_ps(rdy);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), inf = _mm_set1_ps(INFINITY);
+	__m128 vMin = inf;
+	for (; e + 4 <= edges.count; e += 4)
+	{
+		__m128 sx = _mm_load_ps(edges.startX + e), sy = _mm_load_ps(edges.startY + e);
+		__m128 sdx = _mm_load_ps(edges.dx + e), sdy = _mm_load_ps(edges.dy + e);
+
+		__m128 t2 = _mm_div_ps(
+			_mm_add_ps(_mm_mul_ps(rx, _mm_sub_ps(sy, oy)), _mm_mul_ps(ry, _mm_sub_ps(ox, sx))),
+			_mm_sub_ps(_mm_mul_ps(sdx, ry), _mm_mul_ps(sdy, rx)));
+		__m128 t1 = _mm_div_ps(_mm_sub_ps(_mm_add_ps(sx, _mm_mul_ps(sdx, t2)), ox), rx);
+
+		// Lanes that miss (or aren't tested at all) keep INFINITY
+		__m128 valid = _mm_and_ps(
+			_mm_andnot_ps(_mm_cmpeq_ps(sdx, rx), _mm_andnot_ps(_mm_cmpeq_ps(sdy, ry), _mm_cmpord_ps(sdx, sdy))),
+			_mm_and_ps(_mm_cmpgt_ps(t1, zero), _mm_and_ps(_mm_cmpge_ps(t2, zero), _mm_cmple_ps(t2, one))));
+		vMin = _mm_min_ps(vMin, _mm_or_ps(_mm_and_ps(valid, t1), _mm_andnot_ps(valid, inf)));
+	}
+
+	__m128 m = _mm_min_ps(vMin, _mm_movehl_ps(vMin, vMin));
+	m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+	min_t1 = _mm_cvtss_f32(m);
+#endif
+
+	// Whatever is left over (or everything, without SIMD)
+	return min(min_t1, CastRayEdgesScalar(edges, e, originX, originY, rdx, rdy));
+}
+
+/*
+A coverage mask for the light, one byte per pixel, non zero wherever
+light reaches. Triangles are filled a scanline at a time straight into
+the bytes, and only the rows written since the last Clear get cleared.
+Lights with a size get soft shadow edges, each byte then holding how
+much of the light's disc that pixel sees.
+*/
+#define WEDGE_RAYS 16
+
+struct sLightMask {
+	int width = 0;
+	int height = 0;
+	vector<uint8_t> coverage;
+
+	// Rows [dirtyTop, dirtyBottom) may hold non zero coverage
+	int dirtyTop = 0;
+	int dirtyBottom = 0;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		coverage.assign(w * h, 0);
+		dirtyTop = dirtyBottom = 0;
+	}
+
+	void Clear() {
+		if (dirtyBottom > dirtyTop)
+			memset(coverage.data() + dirtyTop * width, 0, (dirtyBottom - dirtyTop) * width);
+		dirtyTop = dirtyBottom = 0;
+	}
+
+	// Call span(y, xStart, xEnd) for the pixels whose centres lie inside the
+	// triangle, row by row. Rows and spans are clipped to the mask once each,
+	// so the pixels themselves need no checks.
+	template<typename F>
+	void ScanTriangle(float x1, float y1, float x2, float y2, float x3, float y3, F span) {
+		// Sort the corners from top to bottom
+		if (y2 < y1) { swap(x1, x2); swap(y1, y2); }
+		if (y3 < y1) { swap(x1, x3); swap(y1, y3); }
+		if (y3 < y2) { swap(x2, x3); swap(y2, y3); }
+		if (y3 == y1)
+			return;
+
+		int yStart = max(0, (int)ceilf(y1 - 0.5f));
+		int yEnd = min(height, (int)ceilf(y3 - 0.5f));
+		if (yStart >= yEnd)
+			return;
+
+		// The long side runs from top to bottom, the other two meet at the middle corner
+		float fLongSlope = (x3 - x1) / (y3 - y1);
+		float fTopSlope = y2 > y1 ? (x2 - x1) / (y2 - y1) : 0.0f;
+		float fBottomSlope = y3 > y2 ? (x3 - x2) / (y3 - y2) : 0.0f;
+
+		for (int y = yStart; y < yEnd; y++)
+		{
+			float fy = y + 0.5f;
+			float xa = x1 + (fy - y1) * fLongSlope;
+			float xb = fy < y2 ? x1 + (fy - y1) * fTopSlope : x2 + (fy - y2) * fBottomSlope;
+			if (xa > xb) swap(xa, xb);
+
+			int xStart = max(0, (int)ceilf(xa - 0.5f));
+			int xEnd = min(width, (int)ceilf(xb - 0.5f));
+			if (xStart < xEnd)
+				span(y, xStart, xEnd);
+		}
+
+		if (dirtyBottom == dirtyTop) { dirtyTop = yStart; dirtyBottom = yEnd; }
+		else { dirtyTop = min(dirtyTop, yStart); dirtyBottom = max(dirtyBottom, yEnd); }
+	}
+
+	// Fill the pixels whose centres lie inside the triangle
+	void FillTriangle(float x1, float y1, float x2, float y2, float x3, float y3, uint8_t value = 255) {
+		ScanTriangle(x1, y1, x2, y2, x3, y3, [&](int y, int xStart, int xEnd)
+		{
+			memset(coverage.data() + y * width + xStart, value, xEnd - xStart);
+		});
+	}
+
+	// The penumbra wedge of one silhouette vertex (vx, vy). (dx, dy) is the
+	// unit direction of the hard shadow edge, away from the light, and the
+	// wedge opens fSinHalf either side of it, reaching fLength along it. A
+	// pixel sees the part of the disc on one side of its line through the
+	// vertex, a circular segment worked out from its angle off the hard edge.
+	// fShadowSide is +1 when the shadow lies to the left of (dx, dy), -1 when
+	// to the right. Pixels can only darken on the lit side and only brighten
+	// on the shadow side, so overlapping wedges may go in any order. Each
+	// side is cut into WEDGE_RAYS slices by angle, slice k ending at
+	// u = (k / WEDGE_RAYS)^2 so they are finest by the hard edge, and pixels
+	// only brighten closer to the vertex than pReach says the walls are in
+	// their slice, so no light gets into or behind them. Pixels on the hard
+	// edge the fan missed get the wedge's light rather than staying dark.
+	void FillWedge(float vx, float vy, float dx, float dy, float fSinHalf, float fLength, float fShadowSide, const float *pReach) {
+		// Coverage for u, the signed offset of the disc's centre from the
+		// line, in disc radii: u = -1 sees all of it, u = 1 none
+		static const array<uint8_t, 257> Segment = []
+		{
+			array<uint8_t, 257> table;
+			for (int i = 0; i <= 256; i++)
+			{
+				float u = i / 128.0f - 1.0f;
+				table[i] = (uint8_t)(255.0f * (acosf(u) - u * sqrtf(max(0.0f, 1.0f - u * u))) / 3.14159f + 0.5f);
+			}
+			return table;
+		}();
+
+		float fCosHalf = sqrtf(max(0.0f, 1.0f - fSinHalf * fSinHalf));
+		float fReach = fLength / max(fCosHalf, 0.1f);
+		float ax = (dx * fCosHalf - dy * fSinHalf) * fReach, ay = (dy * fCosHalf + dx * fSinHalf) * fReach;
+		float bx = (dx * fCosHalf + dy * fSinHalf) * fReach, by = (dy * fCosHalf - dx * fSinHalf) * fReach;
+		float fScale = fShadowSide / fSinHalf;
+
+		ScanTriangle(vx, vy, vx + ax, vy + ay, vx + bx, vy + by, [&](int y, int xStart, int xEnd)
+		{
+			uint8_t *row = coverage.data() + y * width;
+			float wy = y + 0.5f - vy;
+			for (int x = xStart; x < xEnd; x++)
+			{
+				float wx = x + 0.5f - vx;
+				float fDist = sqrtf(wx * wx + wy * wy);
+				if (fDist < 0.5f)
+					continue;
+
+				float fOff = dx * wy - dy * wx;
+				float u = min(1.0f, max(-1.0f, fOff * fScale / fDist));
+				uint8_t c = Segment[(int)((u + 1.0f) * 128.0f + 0.5f)];
+				int nSlice = (int)(sqrtf(fabs(u)) * WEDGE_RAYS);
+				nSlice = u > 0.0f ? WEDGE_RAYS + min(WEDGE_RAYS - 1, nSlice) : WEDGE_RAYS - 1 - min(WEDGE_RAYS - 1, nSlice);
+				bool bReached = fDist <= pReach[nSlice];
+				if (u <= 0.0f)
+					row[x] = row[x] == 0 && bReached && fabs(fOff) < 1.0f ? c : min(row[x], c);
+				else if (bReached)
+					row[x] = max(row[x], c);
+			}
+		});
+	}
+
+	// Soften the shadow edges of a fan filled for a disc light of radius
+	// fSize. Wherever the polygon steps out, at one angle, from a corner to
+	// a farther wall, the corner is a silhouette vertex of the PolyMap and
+	// the step is a hard shadow edge, which gets a penumbra wedge. How far
+	// the shadow side of each wedge may reach comes from rays cast past the
+	// corner: cast(x, y, rdx, rdy) is how far along (rdx, rdy), at most its
+	// length, a ray from (x, y) gets before hitting a wall.
+	template<typename F>
+	void FillPenumbrae(float fSourceX, float fSourceY, float fSize, const vector<tuple<float, float, float>> &vecPoints, F cast) {
+		size_t n = vecPoints.size();
+		if (fSize <= 0.0f || n < 3)
+			return;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			size_t j = i + 1 < n ? i + 1 : 0;
+			float ax = get<1>(vecPoints[i]) - fSourceX, ay = get<2>(vecPoints[i]) - fSourceY;
+			float bx = get<1>(vecPoints[j]) - fSourceX, by = get<2>(vecPoints[j]) - fSourceY;
+			float la = sqrtf(ax * ax + ay * ay), lb = sqrtf(bx * bx + by * by);
+
+			// Same direction from the light, different distances
+			if (fabs(ax * by - ay * bx) > 0.002f * la * lb || ax * bx + ay * by <= 0.0f || fabs(lb - la) < 1.0f)
+				continue;
+
+			// The corner, and its other neighbour, which lies along the occluder
+			bool bFirstNear = la < lb;
+			size_t v = bFirstNear ? i : j;
+			size_t o = bFirstNear ? (i + n - 1) % n : (j + 1) % n;
+			float fDist = min(la, lb);
+			if (fDist < fSize * 1.5f)
+				continue;
+
+			// A spike out and straight back, where a ray got through blocks
+			// touching at a corner, is no wider than a point and lets no light by
+			float fx = bFirstNear ? bx : ax, fy = bFirstNear ? by : ay, lf = max(la, lb);
+			size_t g = bFirstNear ? (j + 1) % n : (i + n - 1) % n;
+			float gx = get<1>(vecPoints[g]) - fSourceX, gy = get<2>(vecPoints[g]) - fSourceY;
+			float lg = sqrtf(gx * gx + gy * gy);
+			if (fabs(fx * gy - fy * gx) <= 0.002f * lf * lg && fx * gx + fy * gy > 0.0f && lg < lf - 1.0f)
+				continue;
+
+			float vx = get<1>(vecPoints[v]), vy = get<2>(vecPoints[v]);
+			float dx = (vx - fSourceX) / fDist, dy = (vy - fSourceY) / fDist;
+			float fSide = dx * (get<2>(vecPoints[o]) - vy) - dy * (get<1>(vecPoints[o]) - vx);
+			if (fSide == 0.0f)
+				continue;
+
+			float fSinHalf = fSize / fDist, fLength = fabs(lb - la);
+			float fShadowSide = fSide > 0.0f ? 1.0f : -1.0f;
+
+			// The rays bounding the slices, from the lit side of the wedge round
+			// to the shadow side. They start half a pixel back from the corner
+			// and a hair to the lit side, so they don't clip it. The PolyMap's
+			// edges run along the grid, so the walls between two hits come no
+			// closer than they do, or than the corners of the box they span. A
+			// slice ends there, less a pixel for the pixels' centres.
+			float nx = -dy * fShadowSide, ny = dx * fShadowSide;
+			float ox = vx - dx * 0.5f - nx * 0.1f, oy = vy - dy * 0.5f - ny * 0.1f;
+			float fRayLength = fLength / max(sqrtf(max(0.0f, 1.0f - fSinHalf * fSinHalf)), 0.1f) + 1.0f;
+			float fHitX[2 * WEDGE_RAYS + 1], fHitY[2 * WEDGE_RAYS + 1], fReach[2 * WEDGE_RAYS];
+			for (int k = 0; k <= 2 * WEDGE_RAYS; k++)
+			{
+				float f = (k - WEDGE_RAYS) / (float)WEDGE_RAYS;
+				float s = fSinHalf * f * fabs(f), c = sqrtf(max(0.0f, 1.0f - s * s));
+				float rdx = dx * c + nx * s, rdy = dy * c + ny * s;
+				float fHit = cast(ox, oy, rdx * fRayLength, rdy * fRayLength);
+				fHitX[k] = rdx * fHit;
+				fHitY[k] = rdy * fHit;
+			}
+			for (int k = 0; k < 2 * WEDGE_RAYS; k++)
+			{
+				float x1 = fHitX[k], y1 = fHitY[k], x2 = fHitX[k + 1], y2 = fHitY[k + 1];
+				fReach[k] = min(min(hypotf(x1, y1), hypotf(x2, y2)), min(hypotf(x1, y2), hypotf(x2, y1))) - 1.0f;
+			}
+
+			FillWedge(vx, vy, dx, dy, fSinHalf, fLength, fShadowSide, fReach);
+		}
+	}
+
+	// Fill a visibility polygon as a triangle fan around its light source
+	void FillFan(float fSourceX, float fSourceY, const vector<tuple<float, float, float>> &vecPoints) {
+		if (vecPoints.size() < 2)
+			return;
+
+		// Fan will have one open edge, so also do last point of fan to first
+		for (size_t i = 0; i < vecPoints.size(); i++)
+		{
+			size_t j = i + 1 < vecPoints.size() ? i + 1 : 0;
+			FillTriangle(
+				fSourceX, fSourceY,
+				get<1>(vecPoints[i]), get<2>(vecPoints[i]),
+				get<1>(vecPoints[j]), get<2>(vecPoints[j]));
+		}
+	}
+};
+
+/*
+The light of any number of coloured lights added together, 16 bits per
+channel. Each light adds its own falloff sprite, tinted by its colour,
+under its own mask; ToneMap then writes the sum out as 8 bit pixels in
+one pass. Only the rows added to since the last Clear are touched.
+*/
+struct sLightAccumulator {
+	int width = 0;
+	int height = 0;
+	vector<uint16_t> channels;	// r, g, b, a for each pixel
+
+	// Rows [dirtyTop, dirtyBottom) may hold light
+	int dirtyTop = 0;
+	int dirtyBottom = 0;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		channels.assign(4 * w * h, 0);
+		dirtyTop = dirtyBottom = 0;
+	}
+
+	void Clear() {
+		if (dirtyBottom > dirtyTop)
+			memset(channels.data() + 4 * dirtyTop * width, 0, sizeof(uint16_t) * 4 * (dirtyBottom - dirtyTop) * width);
+		dirtyTop = dirtyBottom = 0;
+	}
+
+	// Start again from another accumulator of the same size
+	void CopyFrom(const sLightAccumulator &other) {
+		Clear();
+		dirtyTop = other.dirtyTop;
+		dirtyBottom = other.dirtyBottom;
+		if (dirtyBottom > dirtyTop)
+			memcpy(channels.data() + 4 * dirtyTop * width, other.channels.data() + 4 * dirtyTop * width,
+				sizeof(uint16_t) * 4 * (dirtyBottom - dirtyTop) * width);
+	}
+
+	// Add the falloff sprite, its top left corner at (left, top), tinted by
+	// colour, wherever the mask (the size of the accumulator) has light
+	void AddLight(const sLightMask &mask, olc::Sprite *falloff, int left, int top, olc::Pixel colour, bool bSimd = true) {
+		int yStart = max({ top, mask.dirtyTop, 0 });
+		int yEnd = min({ top + falloff->height, mask.dirtyBottom, height });
+		int xStart = max(left, 0);
+		int xEnd = min(left + falloff->width, width);
+		if (yStart >= yEnd || xStart >= xEnd)
+			return;
+
+		for (int y = yStart; y < yEnd; y++)
+		{
+			uint16_t *acc = channels.data() + 4 * (y * width + xStart);
+			const olc::Pixel *src = falloff->GetData() + (y - top) * falloff->width + (xStart - left);
+			const uint8_t *cover = mask.coverage.data() + y * width + xStart;
+			if (bSimd)
+				AccumulateMasked(acc, src, cover, colour, xEnd - xStart);
+			else
+				AccumulateMaskedScalar(acc, src, cover, colour, xEnd - xStart);
+		}
+
+		if (dirtyBottom == dirtyTop) { dirtyTop = yStart; dirtyBottom = yEnd; }
+		else { dirtyTop = min(dirtyTop, yStart); dirtyBottom = max(dirtyBottom, yEnd); }
+	}
+
+	// Write the tone mapped light over dst (the size of the accumulator)
+	// wherever any light was added
+	void ToneMap(olc::Pixel *dst, bool bSimd = true) const {
+		int first = dirtyTop * width;
+		int count = (dirtyBottom - dirtyTop) * width;
+		if (bSimd)
+			ToneMapped(dst + first, channels.data() + 4 * first, count);
+		else
+			ToneMappedScalar(dst + first, channels.data() + 4 * first, count);
+	}
+};
+
+/*
+A read only view of a whole file. Nothing is read up front, the OS pages
+the file in as it is touched.
+*/
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile() { Close(); }
+
+	bool Open(const string &sFile) {
+		Close();
+#if defined(_WIN32)
+		hFile = CreateFileA(sFile.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0)
+			hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (hMapping)
+			data = (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (data)
+			size = (size_t)fileSize.QuadPart;
+#else
+		fd = open(sFile.c_str(), O_RDONLY);
+		if (fd == -1)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				data = (const uint8_t *)p;
+				size = st.st_size;
+			}
+		}
+#endif
+		if (!data)
+			Close();
+		return data != nullptr;
+	}
+
+	void Close() {
+#if defined(_WIN32)
+		if (data) UnmapViewOfFile(data);
+		if (hMapping) CloseHandle(hMapping);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+		hMapping = nullptr;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap((void *)data, size);
+		if (fd != -1) close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const uint8_t *Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+#if defined(_WIN32)
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+/*
+Binary tile-map file, written by ChunkedWorld::Save and mapped by Open.
+All values are little endian.
+	header       sTileMapHeader
+	directory    one sTileMapChunk per stored chunk, sorted by (cy, cx)
+	chunk data   for each chunk, at its offset:
+	               exist bits, 1 per cell, row by row    (CHUNK_SIZE^2 / 8 bytes)
+	               boundary bits, only with TILEMAP_CHUNK_BOUNDARY
+	               nEdges edges of 4 bytes: start corner x and y within the
+	               chunk, length in cells, side; only with TILEMAP_EDGES
+Empty chunks are not stored at all.
+*/
+#define TILEMAP_VERSION 1
+#define TILEMAP_EDGES 1				// sTileMapHeader::nFlags: chunks carry their edges
+#define TILEMAP_CHUNK_BOUNDARY 1	// sTileMapChunk::nFlags: chunk has boundary bits
+
+struct sTileMapHeader {
+	char magic[4];					// "SCTM"
+	uint32_t nVersion;
+	uint32_t nChunkSize;
+	uint32_t nFlags;
+	uint64_t nChunks;
+};
+
+struct sTileMapChunk {
+	int32_t cx, cy;
+	uint64_t nOffset;
+	uint32_t nEdges;
+	uint32_t nFlags;
+};
+
+static_assert(sizeof(sTileMapHeader) == 24 && sizeof(sTileMapChunk) == 24, "tile-map structs must match the file layout");
+
+/*
+An unbounded tile world split into square chunks of CHUNK_SIZE cells.
+Chunks are only allocated once a block is placed in them and freed again
+when their last block goes. Each chunk owns the edges of its own blocks,
+cut at its borders, and rebuilds them when a cell in or next to it
+changes. GatherEdges joins the pieces of the chunks asked for back into
+whole edges, so only the chunks around a light need to be looked at.
+A world can also be backed by a tile-map file, whose chunks are only
+read in (PageIn) once something needs them.
+*/
+#define CHUNK_SHIFT 6
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+
+static_assert(CHUNK_SIZE == 64, "a row of a chunk is one 64 bit word");
+
+// Index of the lowest set bit, bits must not be 0
+inline int LowestBit(uint64_t bits) {
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i, bits);
+	return (int)i;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// Number of set bits
+inline int BitCount(uint64_t bits) {
+#if defined(_MSC_VER)
+	return (int)__popcnt64(bits);
+#else
+	return __builtin_popcountll(bits);
+#endif
+}
+
+struct sChunk {
+	// One bit per cell, bit x of row y, the same as in the tile-map file
+	uint64_t exist[CHUNK_SIZE] = {};
+	uint64_t boundary[CHUNK_SIZE] = {};
+	int nBlocks = 0;
+
+	// Edges by side (NORTH, SOUTH, EAST, WEST). bDirty is set while the
+	// chunk waits for RefreshEdges to rebuild them.
+	vector<sEdge> edges[4];
+	bool bDirty = false;
+};
+
+class ChunkedWorld {
+public:
+	// An edge of GatherEdges' output ending on a chunk border, and the chunk
+	// whose piece of it would carry on from there
+	struct sOpenEnd {
+		int cx, cy;
+		int edge_id;
+	};
+
+	// Working memory of GatherEdges, one per thread calling it
+	struct sGatherScratch {
+		vector<pair<int, int>> vecChunks;
+		vector<int> vecColumns;
+		vector<sOpenEnd> vecOpenEnds;
+	};
+
+	ChunkedWorld(float fBlockWidth) : fBlockWidth(fBlockWidth), fChunkWidth(fBlockWidth * CHUNK_SIZE) {}
+
+	// Chunks not read in yet are looked up in the file
+	bool GetCell(int x, int y) const {
+		return (RowBits(x >> CHUNK_SHIFT, y >> CHUNK_SHIFT, y & (CHUNK_SIZE - 1)) >> (x & (CHUNK_SIZE - 1))) & 1;
+	}
+
+	bool IsBoundary(int x, int y) const {
+		int cx = x >> CHUNK_SHIFT, cy = y >> CHUNK_SHIFT;
+		uint64_t row = 0;
+		if (const sChunk *chunk = FindChunk(cx, cy))
+			row = chunk->boundary[y & (CHUNK_SIZE - 1)];
+		else if (const sTileMapChunk *stored = FindStoredChunk(cx, cy))
+			if (stored->nFlags & TILEMAP_CHUNK_BOUNDARY)
+				memcpy(&row, file.Data() + stored->nOffset + sizeof(sChunk::exist) + (y & (CHUNK_SIZE - 1)) * sizeof(uint64_t), sizeof(row));
+		return (row >> (x & (CHUNK_SIZE - 1))) & 1;
+	}
+
+	void SetCell(int x, int y, bool bExist, bool bBoundary = false) {
+		int cx = x >> CHUNK_SHIFT, cy = y >> CHUNK_SHIFT;
+		int chunk_id = ResidentChunk(cx, cy);
+		if (chunk_id == -1)
+		{
+			if (const sTileMapChunk *stored = FindStoredChunk(cx, cy))
+				chunk_id = LoadChunk(*stored);
+			else if (!bExist)
+				return;
+			else
+			{
+				chunk_id = AllocateChunk();
+				chunks[ChunkKey(cx, cy)] = chunk_id;
+			}
+		}
+
+		sChunk &chunk = vecChunkPool[chunk_id];
+		uint64_t bit = 1ull << (x & (CHUNK_SIZE - 1));
+		uint64_t &row = chunk.exist[y & (CHUNK_SIZE - 1)];
+		uint64_t &boundary = chunk.boundary[y & (CHUNK_SIZE - 1)];
+		boundary = bExist && bBoundary ? boundary | bit : boundary & ~bit;
+		if (((row & bit) != 0) == bExist)
+			return;
+		row ^= bit;
+		chunk.nBlocks += bExist ? 1 : -1;
+
+		// The cell decides the edges of its neighbours too, which may lie in the
+		// next chunk. Marking them may read them in and move the pool, so chunk
+		// is not used after this.
+		MarkDirty(cx, cy);
+		if ((x & (CHUNK_SIZE - 1)) == 0) MarkDirty(cx - 1, cy);
+		if ((x & (CHUNK_SIZE - 1)) == CHUNK_SIZE - 1) MarkDirty(cx + 1, cy);
+		if ((y & (CHUNK_SIZE - 1)) == 0) MarkDirty(cx, cy - 1);
+		if ((y & (CHUNK_SIZE - 1)) == CHUNK_SIZE - 1) MarkDirty(cx, cy + 1);
+
+		// A chunk of the file has to stay, empty, to hide the stored one
+		if (vecChunkPool[chunk_id].nBlocks == 0 && !FindStoredChunk(cx, cy))
+		{
+			FreeChunk(chunk_id);
+			chunks.erase(ChunkKey(cx, cy));
+		}
+	}
+
+	// Chunks in memory
+	size_t ChunkCount() const {
+		return chunks.size();
+	}
+
+	// Chunks in the file, read in or not
+	size_t StoredChunkCount() const {
+		return nStoredChunks;
+	}
+
+	const sTileMapChunk &StoredChunk(size_t c) const {
+		return directory[c];
+	}
+
+	// Drop everything and take the world from a tile-map file instead. Only
+	// the header is checked, chunks are read in as they are needed.
+	bool Open(const string &sFile) {
+		Clear();
+		if (!file.Open(sFile))
+			return false;
+
+		const sTileMapHeader *header = (const sTileMapHeader *)file.Data();
+		bool bValid = file.Size() >= sizeof(sTileMapHeader) && memcmp(header->magic, "SCTM", 4) == 0 &&
+			header->nVersion == TILEMAP_VERSION && header->nChunkSize == CHUNK_SIZE &&
+			header->nChunks <= (file.Size() - sizeof(sTileMapHeader)) / sizeof(sTileMapChunk);
+		if (!bValid)
+		{
+			file.Close();
+			return false;
+		}
+
+		directory = (const sTileMapChunk *)(file.Data() + sizeof(sTileMapHeader));
+		nStoredChunks = header->nChunks;
+		bStoredEdges = (header->nFlags & TILEMAP_EDGES) != 0;
+		return true;
+	}
+
+	// Write every chunk that has a block out to a tile-map file, with their
+	// edges unless told otherwise. Anything left in a file opened before is
+	// read in first, so it can be written over.
+	bool Save(const string &sFile, bool bEdges = true) {
+		PageInAll();
+		file.Close();
+		directory = nullptr;
+		nStoredChunks = 0;
+		RefreshEdges();
+
+		vector<pair<int, int>> vecSaved;
+		for (auto &chunk : chunks)
+			if (vecChunkPool[chunk.second].nBlocks > 0)
+				vecSaved.push_back({ (int32_t)(chunk.first >> 32), (int32_t)(uint32_t)chunk.first });
+		sort(vecSaved.begin(), vecSaved.end());
+
+		// Lay the chunks out after the directory
+		vector<sTileMapChunk> vecDirectory;
+		uint64_t nOffset = sizeof(sTileMapHeader) + vecSaved.size() * sizeof(sTileMapChunk);
+		for (auto &c : vecSaved)
+		{
+			const sChunk &chunk = *FindChunk(c.second, c.first);
+			sTileMapChunk entry = { c.second, c.first, nOffset, 0, 0 };
+			if (any_of(chunk.boundary, chunk.boundary + CHUNK_SIZE, [](uint64_t row) { return row != 0; }))
+				entry.nFlags |= TILEMAP_CHUNK_BOUNDARY;
+			if (bEdges)
+				for (auto &edges : chunk.edges)
+					entry.nEdges += edges.size();
+			vecDirectory.push_back(entry);
+			nOffset += ChunkBytes(entry);
+		}
+
+		ofstream out(sFile, ios::binary);
+		sTileMapHeader header = { { 'S', 'C', 'T', 'M' }, TILEMAP_VERSION, CHUNK_SIZE, bEdges ? TILEMAP_EDGES : 0u, vecSaved.size() };
+		out.write((const char *)&header, sizeof(header));
+		out.write((const char *)vecDirectory.data(), vecDirectory.size() * sizeof(sTileMapChunk));
+
+		vector<uint8_t> vecBytes;
+		for (auto &entry : vecDirectory)
+		{
+			const sChunk &chunk = *FindChunk(entry.cx, entry.cy);
+			vecBytes.assign(ChunkBytes(entry), 0);
+			uint8_t *p = vecBytes.data();
+
+			memcpy(p, chunk.exist, sizeof(chunk.exist));
+			p += sizeof(chunk.exist);
+
+			if (entry.nFlags & TILEMAP_CHUNK_BOUNDARY)
+			{
+				memcpy(p, chunk.boundary, sizeof(chunk.boundary));
+				p += sizeof(chunk.boundary);
+			}
+
+			if (bEdges)
+				for (int side = 0; side < 4; side++)
+					for (const sEdge &edge : chunk.edges[side])
+					{
+						int x = (int)roundf(edge.startX / fBlockWidth) - entry.cx * CHUNK_SIZE;
+						int y = (int)roundf(edge.startY / fBlockWidth) - entry.cy * CHUNK_SIZE;
+						int length = (int)roundf((edge.endX - edge.startX + edge.endY - edge.startY) / fBlockWidth);
+						*p++ = (uint8_t)x; *p++ = (uint8_t)y; *p++ = (uint8_t)length; *p++ = (uint8_t)side;
+					}
+
+			out.write((const char *)vecBytes.data(), vecBytes.size());
+		}
+
+		return (bool)out;
+	}
+
+	// Read in the stored chunks overlapping the rectangle (in pixels) that
+	// aren't in memory yet
+	void PageIn(float fLeft, float fTop, float fRight, float fBottom) {
+		if (nStoredChunks == 0)
+			return;
+
+		int cx0 = (int)floorf(fLeft / fChunkWidth), cx1 = (int)floorf(fRight / fChunkWidth);
+		int cy0 = (int)floorf(fTop / fChunkWidth), cy1 = (int)floorf(fBottom / fChunkWidth);
+
+		// Rows of the directory are sorted, so each row of the rectangle is one search
+		for (int cy = cy0; cy <= cy1; cy++)
+		{
+			const sTileMapChunk *entry = lower_bound(directory, directory + nStoredChunks, make_pair(cy, cx0),
+				[](const sTileMapChunk &c, const pair<int, int> &key) { return make_pair(c.cy, c.cx) < key; });
+			for (; entry < directory + nStoredChunks && entry->cy == cy && entry->cx <= cx1; entry++)
+				if (InFile(*entry) && ResidentChunk(entry->cx, entry->cy) == -1)
+					LoadChunk(*entry);
+		}
+	}
+
+	void PageInAll() {
+		for (size_t c = 0; c < nStoredChunks; c++)
+			if (InFile(directory[c]) && ResidentChunk(directory[c].cx, directory[c].cy) == -1)
+				LoadChunk(directory[c]);
+	}
+
+	// Rebuild the edges of every chunk changed since the last call. GatherEdges
+	// only reads the chunks, so call this first and the gathers can run in parallel.
+	void RefreshEdges() {
+		for (uint64_t key : vecDirtyChunks)
+		{
+			auto it = chunks.find(key);
+			if (it != chunks.end())
+				BuildChunkEdges(vecChunkPool[it->second], (int32_t)(uint32_t)key, (int32_t)(key >> 32));
+		}
+		vecDirtyChunks.clear();
+	}
+
+	// Append the edges of every chunk overlapping the rectangle (in pixels) to
+	// vecOut. An edge running across chunk borders comes out in one piece.
+	void GatherEdges(float fLeft, float fTop, float fRight, float fBottom, vector<sEdge> &vecOut, sGatherScratch &scratch) const {
+		int cx0 = (int)floorf(fLeft / fChunkWidth), cx1 = (int)floorf(fRight / fChunkWidth);
+		int cy0 = (int)floorf(fTop / fChunkWidth), cy1 = (int)floorf(fBottom / fChunkWidth);
+
+		// Pieces are joined as they come, so chunks go in rows, top to bottom,
+		// each row left to right. When the rectangle covers more chunks than
+		// exist, look through the ones that exist rather than every position.
+		vector<pair<int, int>> &vecChunks = scratch.vecChunks;
+		vecChunks.clear();
+		if ((int64_t)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) <= (int64_t)chunks.size())
+		{
+			for (int cy = cy0; cy <= cy1; cy++)
+				for (int cx = cx0; cx <= cx1; cx++)
+					if (FindChunk(cx, cy))
+						vecChunks.push_back({ cy, cx });
+		}
+		else
+		{
+			for (auto &chunk : chunks)
+			{
+				int cx = (int32_t)(uint32_t)chunk.first, cy = (int32_t)(chunk.first >> 32);
+				if (cx >= cx0 && cx <= cx1 && cy >= cy0 && cy <= cy1)
+					vecChunks.push_back({ cy, cx });
+			}
+			sort(vecChunks.begin(), vecChunks.end());
+		}
+
+		// The distinct chunk columns, so each can have a slot per line of cells
+		vector<int> &vecColumns = scratch.vecColumns;
+		vecColumns.clear();
+		for (auto &c : vecChunks)
+			vecColumns.push_back(c.second);
+		sort(vecColumns.begin(), vecColumns.end());
+		vecColumns.erase(unique(vecColumns.begin(), vecColumns.end()), vecColumns.end());
+
+		// Edges left open on a chunk border, one slot per side and line of cells.
+		// Northern and southern edges go on in the next chunk along the row, so
+		// need one set of slots. Western and eastern ones go on in the next row,
+		// so need a set for every column.
+		vector<sOpenEnd> &vecOpenEnds = scratch.vecOpenEnds;
+		vecOpenEnds.assign((1 + vecColumns.size()) * 2 * CHUNK_SIZE, { 0, 0, -1 });
+
+		for (auto &c : vecChunks)
+		{
+			int cx = c.second, cy = c.first;
+			const sChunk &chunk = *FindChunk(cx, cy);
+			float fChunkX = cx * fChunkWidth, fChunkY = cy * fChunkWidth;
+			int column = 1 + (int)(lower_bound(vecColumns.begin(), vecColumns.end(), cx) - vecColumns.begin());
+
+			for (int side = 0; side < 4; side++)
+				for (const sEdge &piece : chunk.edges[side])
+				{
+					bool vertical = side == WEST || side == EAST;
+					int line = vertical ?
+						(int)roundf((piece.startX - fChunkX) / fBlockWidth) - (side == EAST ? 1 : 0) :
+						(int)roundf((piece.startY - fChunkY) / fBlockWidth) - (side == SOUTH ? 1 : 0);
+					sOpenEnd &slot = vecOpenEnds[((vertical ? column : 0) * 2 + (side & 1)) * CHUNK_SIZE + line];
+
+					// Carry on the edge the previous chunk left open here
+					int edge_id = -1;
+					if ((vertical ? piece.startY == fChunkY : piece.startX == fChunkX) && slot.edge_id != -1 && slot.cx == cx && slot.cy == cy)
+					{
+						edge_id = slot.edge_id;
+						vecOut[edge_id].endX = piece.endX;
+						vecOut[edge_id].endY = piece.endY;
+					}
+					if (edge_id == -1)
+					{
+						edge_id = vecOut.size();
+						vecOut.push_back(piece);
+					}
+
+					if (vertical ? piece.endY == fChunkY + fChunkWidth : piece.endX == fChunkX + fChunkWidth)
+						slot = { vertical ? cx : cx + 1, vertical ? cy + 1 : cy, edge_id };
+				}
+		}
+	}
+
+private:
+	float fBlockWidth;
+	float fChunkWidth;
+	// Pool of chunks, found by position, with the slots of freed ones reused first
+	vector<sChunk> vecChunkPool;
+	vector<int> vecFreeChunkIds;
+	unordered_map<uint64_t, int> chunks;
+	vector<uint64_t> vecDirtyChunks;
+
+	// The tile-map file behind the world, if any
+	MappedFile file;
+	const sTileMapChunk *directory = nullptr;
+	size_t nStoredChunks = 0;
+	bool bStoredEdges = false;
+
+	void Clear() {
+		vecChunkPool.clear();
+		vecFreeChunkIds.clear();
+		chunks.clear();
+		vecDirtyChunks.clear();
+		file.Close();
+		directory = nullptr;
+		nStoredChunks = 0;
+		bStoredEdges = false;
+	}
+
+	static size_t ChunkBytes(const sTileMapChunk &entry) {
+		size_t nBits = sizeof(sChunk::exist);
+		return nBits + (entry.nFlags & TILEMAP_CHUNK_BOUNDARY ? nBits : 0) + entry.nEdges * 4;
+	}
+
+	// Row y of a chunk's exist bits, in memory or in the file, 0 where there is no chunk
+	uint64_t RowBits(int cx, int cy, int y) const {
+		if (const sChunk *chunk = FindChunk(cx, cy))
+			return chunk->exist[y];
+		uint64_t row = 0;
+		if (const sTileMapChunk *stored = FindStoredChunk(cx, cy))
+			memcpy(&row, file.Data() + stored->nOffset + y * sizeof(uint64_t), sizeof(row));
+		return row;
+	}
+
+	const sTileMapChunk *FindStoredChunk(int cx, int cy) const {
+		if (nStoredChunks == 0)
+			return nullptr;
+		const sTileMapChunk *entry = lower_bound(directory, directory + nStoredChunks, make_pair(cy, cx),
+			[](const sTileMapChunk &c, const pair<int, int> &key) { return make_pair(c.cy, c.cx) < key; });
+		return entry < directory + nStoredChunks && entry->cx == cx && entry->cy == cy && InFile(*entry) ? entry : nullptr;
+	}
+
+	// A chunk running past the end of the file is taken as missing
+	bool InFile(const sTileMapChunk &entry) const {
+		return entry.nOffset <= file.Size() && ChunkBytes(entry) <= file.Size() - entry.nOffset;
+	}
+
+	int ResidentChunk(int cx, int cy) const {
+		auto it = chunks.find(ChunkKey(cx, cy));
+		return it == chunks.end() ? -1 : it->second;
+	}
+
+	// Copy a stored chunk into memory. Its stored edges are taken as they
+	// are: a neighbour changed since would have read it in first.
+	int LoadChunk(const sTileMapChunk &entry) {
+		int chunk_id = AllocateChunk();
+		chunks[ChunkKey(entry.cx, entry.cy)] = chunk_id;
+		sChunk &chunk = vecChunkPool[chunk_id];
+
+		const uint8_t *p = file.Data() + entry.nOffset;
+		memcpy(chunk.exist, p, sizeof(chunk.exist));
+		p += sizeof(chunk.exist);
+		for (uint64_t row : chunk.exist)
+			chunk.nBlocks += bitset<64>(row).count();
+
+		if (entry.nFlags & TILEMAP_CHUNK_BOUNDARY)
+		{
+			memcpy(chunk.boundary, p, sizeof(chunk.boundary));
+			p += sizeof(chunk.boundary);
+		}
+
+		if (!bStoredEdges)
+		{
+			MarkDirty(entry.cx, entry.cy);
+			return chunk_id;
+		}
+
+		float fChunkX = entry.cx * fChunkWidth, fChunkY = entry.cy * fChunkWidth;
+		for (uint32_t e = 0; e < entry.nEdges; e++, p += 4)
+		{
+			int side = p[3] & 3;
+			bool vertical = side == WEST || side == EAST;
+			sEdge edge;
+			edge.startX = fChunkX + p[0] * fBlockWidth;
+			edge.startY = fChunkY + p[1] * fBlockWidth;
+			edge.endX = edge.startX + (vertical ? 0 : p[2]) * fBlockWidth;
+			edge.endY = edge.startY + (vertical ? p[2] : 0) * fBlockWidth;
+			chunk.edges[side].push_back(edge);
+		}
+		return chunk_id;
+	}
+
+	static uint64_t ChunkKey(int cx, int cy) {
+		return ((uint64_t)(uint32_t)cy << 32) | (uint32_t)cx;
+	}
+
+	const sChunk *FindChunk(int cx, int cy) const {
+		auto it = chunks.find(ChunkKey(cx, cy));
+		return it == chunks.end() ? nullptr : &vecChunkPool[it->second];
+	}
+
+	int AllocateChunk() {
+		if (vecFreeChunkIds.empty())
+		{
+			vecChunkPool.push_back(sChunk());
+			return vecChunkPool.size() - 1;
+		}
+
+		int chunk_id = vecFreeChunkIds.back();
+		vecFreeChunkIds.pop_back();
+		return chunk_id;
+	}
+
+	// Only called once the chunk is empty, so its cells are all clear already
+	void FreeChunk(int chunk_id) {
+		sChunk &chunk = vecChunkPool[chunk_id];
+		fill(chunk.boundary, chunk.boundary + CHUNK_SIZE, 0);
+		for (auto &edges : chunk.edges)
+			edges.clear();
+		chunk.bDirty = false;
+		vecFreeChunkIds.push_back(chunk_id);
+	}
+
+	// Queue a chunk for RefreshEdges. A stored one not read in yet is read in,
+	// its stored edges won't do any more.
+	void MarkDirty(int cx, int cy) {
+		int chunk_id = ResidentChunk(cx, cy);
+		if (chunk_id == -1)
+		{
+			const sTileMapChunk *stored = FindStoredChunk(cx, cy);
+			if (!stored)
+				return;
+			chunk_id = LoadChunk(*stored);
+		}
+
+		if (vecChunkPool[chunk_id].bDirty)
+			return;
+		vecChunkPool[chunk_id].bDirty = true;
+		vecDirtyChunks.push_back(ChunkKey(cx, cy));
+	}
+
+	// Extract the edges of one chunk from its bits, a whole row of cells at a
+	// time. A block needs a northern edge where the cell above is clear, so
+	// row & ~above gives every northern edge of the row at once, and likewise
+	// the row below for southern edges and the row shifted a cell either way
+	// for western and eastern ones. Runs of set bits then become the edges,
+	// stopping at the chunk border, the same ones ConvertTileMapToPolyMap makes.
+	void BuildChunkEdges(sChunk &chunk, int cx, int cy) {
+		int x0 = cx * CHUNK_SIZE, y0 = cy * CHUNK_SIZE;
+		for (auto &edges : chunk.edges)
+			edges.clear();
+
+		auto add = [&](int side, int sx, int sy, int ex, int ey)
+		{
+			sEdge edge;
+			edge.startX = sx * fBlockWidth; edge.startY = sy * fBlockWidth;
+			edge.endX = ex * fBlockWidth; edge.endY = ey * fBlockWidth;
+			chunk.edges[side].push_back(edge);
+		};
+
+		// The cells just over the western and eastern borders, bit y for row y
+		uint64_t westColumn = 0, eastColumn = 0;
+		const sChunk *west = FindChunk(cx - 1, cy), *east = FindChunk(cx + 1, cy);
+		for (int y = 0; y < CHUNK_SIZE; y++)
+		{
+			westColumn |= ((west ? west->exist[y] : RowBits(cx - 1, cy, y)) >> (CHUNK_SIZE - 1)) << y;
+			eastColumn |= ((east ? east->exist[y] : RowBits(cx + 1, cy, y)) & 1) << y;
+		}
+
+		// Western and eastern edges run down the columns. Each has a bit per
+		// column still in a run, and the row that run started on.
+		uint64_t open[2] = { 0, 0 };
+		int runStart[2][CHUNK_SIZE];
+
+		for (int y = 0; y <= CHUNK_SIZE; y++)
+		{
+			uint64_t row = y < CHUNK_SIZE ? chunk.exist[y] : 0;
+
+			if (y < CHUNK_SIZE)
+			{
+				uint64_t above = y > 0 ? chunk.exist[y - 1] : RowBits(cx, cy - 1, CHUNK_SIZE - 1);
+				uint64_t below = y < CHUNK_SIZE - 1 ? chunk.exist[y + 1] : RowBits(cx, cy + 1, 0);
+
+				for (int side : { NORTH, SOUTH })
+				{
+					uint64_t mask = row & ~(side == NORTH ? above : below);
+					while (mask)
+					{
+						int start = LowestBit(mask);
+						uint64_t rest = ~(mask >> start);
+						int length = rest ? LowestBit(rest) : CHUNK_SIZE;
+						int edgeY = y0 + y + (side == SOUTH ? 1 : 0);
+						add(side, x0 + start, edgeY, x0 + start + length, edgeY);
+						mask = start + length >= CHUNK_SIZE ? 0 : mask & (~0ull << (start + length));
+					}
+				}
+			}
+
+			// Neighbours to the west and east, bit x for column x. Past the last
+			// row there are no blocks, so every run still open ends there.
+			uint64_t westCells = 0, eastCells = 0;
+			if (y < CHUNK_SIZE)
+			{
+				westCells = (row << 1) | ((westColumn >> y) & 1);
+				eastCells = (row >> 1) | (((eastColumn >> y) & 1) << (CHUNK_SIZE - 1));
+			}
+
+			for (int s = 0; s < 2; s++)
+			{
+				int side = s == 0 ? WEST : EAST;
+				uint64_t mask = row & ~(s == 0 ? westCells : eastCells);
+
+				// Runs ending on this row, then runs starting on it
+				for (uint64_t ended = open[s] & ~mask; ended; ended &= ended - 1)
+				{
+					int x = LowestBit(ended);
+					int edgeX = x0 + x + (side == EAST ? 1 : 0);
+					add(side, edgeX, y0 + runStart[s][x], edgeX, y0 + y);
+				}
+				for (uint64_t started = mask & ~open[s]; started; started &= started - 1)
+					runStart[s][LowestBit(started)] = y;
+				open[s] = mask;
+			}
+		}
+
+		chunk.bDirty = false;
+	}
+};
+
+// A stand in for atan2f(dy, dx): not an angle, but it rises and falls with
+// it, from -2 (pointing west from below) round to 2 (west from above).
+// Sorting by it gives the same order as sorting by angle.
+inline float PseudoAngle(float dy, float dx) {
+	float sum = fabs(dx) + fabs(dy);
+	if (sum == 0.0f)
+		return 0.0f;
+	float r = dx / sum;
+	return dy < 0.0f ? r - 1.0f : 1.0f - r;
+}
+
+/*
+Answers "is this point lit?" for one light's visibility polygon, the fan
+of points around it sorted by angle, without rasterizing or casting again.
+The range of PseudoAngle is cut into equal bins, each knowing the first
+point at or past its start, so the fan triangle holding a point's angle
+is a step or two from there. One cross product then says whether the
+point is on the light's side of that triangle's outer edge.
+*/
+struct sVisibilityLookup {
+	float x = 0.0f, y = 0.0f;
+
+	// The points from the smallest PseudoAngle round, with their keys
+	vector<float> vecKeys;
+	vector<float> vecX, vecY;
+
+	// The first point whose key is at or past the start of each bin
+	vector<int> vecBins;
+	int nBins = 0;
+	float fBinScale = 0.0f;
+
+	void Build(float fSourceX, float fSourceY, const vector<tuple<float, float, float>> &vecPoints) {
+		x = fSourceX;
+		y = fSourceY;
+		int n = vecPoints.size();
+		vecKeys.resize(n);
+		vecX.resize(n);
+		vecY.resize(n);
+		if (n < 2)
+			return;
+
+		// Keys from the points themselves, whatever the engine sorted by, and
+		// starting from the smallest, wherever the polygon starts
+		int first = 0;
+		for (int i = 0; i < n; i++)
+		{
+			vecKeys[i] = PseudoAngle(get<2>(vecPoints[i]) - y, get<1>(vecPoints[i]) - x);
+			if (vecKeys[i] < vecKeys[first])
+				first = i;
+		}
+		rotate(vecKeys.begin(), vecKeys.begin() + first, vecKeys.end());
+		for (int i = 0; i < n; i++)
+		{
+			vecX[i] = get<1>(vecPoints[(first + i) % n]);
+			vecY[i] = get<2>(vecPoints[(first + i) % n]);
+			if (i > 0)	// Points at one angle may be out by a rounding
+				vecKeys[i] = max(vecKeys[i], vecKeys[i - 1]);
+		}
+
+		nBins = 16;
+		while (nBins < n)
+			nBins *= 2;
+		fBinScale = nBins / 4.0f;
+		vecBins.resize(nBins);
+		for (int b = 0, i = 0; b < nBins; b++)
+		{
+			float fStart = b / fBinScale - 2.0f;
+			while (i < n && vecKeys[i] < fStart)
+				i++;
+			vecBins[b] = i;
+		}
+	}
+
+	bool IsLit(float px, float py) const {
+		int n = vecKeys.size();
+		if (n < 2)
+			return false;
+
+		float k = PseudoAngle(py - y, px - x);
+		int i = vecBins[min(nBins - 1, max(0, (int)((k + 2.0f) * fBinScale)))];
+		while (i < n && vecKeys[i] <= k)
+			i++;
+
+		// The triangle from point a to point c holds the angle, the last one
+		// closing the fan from the last point to the first
+		int a = i == 0 || i == n ? n - 1 : i - 1;
+		int c = i == n ? 0 : i;
+		float ex = vecX[c] - vecX[a], ey = vecY[c] - vecY[a];
+		float fLightSide = ex * (y - vecY[a]) - ey * (x - vecX[a]);
+		float fPointSide = ex * (py - vecY[a]) - ey * (px - vecX[a]);
+		return fLightSide * fPointSide >= 0.0f;
+	}
+};
+
+/*
+Which tiles of a grid can be seen, one bit per tile: bit x & 63 of word
+y * nRowWords + x / 64.
+*/
+struct sTileVisibility {
+	int width = 0;
+	int height = 0;
+	int nRowWords = 0;
+	vector<uint64_t> bits;
+
+	void Resize(int w, int h) {
+		width = w;
+		height = h;
+		nRowWords = (w + 63) / 64;
+		bits.assign(nRowWords * h, 0);
+	}
+
+	void Clear() {
+		fill(bits.begin(), bits.end(), 0);
+	}
+
+	bool Get(int x, int y) const {
+		return (bits[y * nRowWords + (x >> 6)] >> (x & 63)) & 1;
+	}
+
+	void Set(int x, int y) {
+		bits[y * nRowWords + (x >> 6)] |= uint64_t(1) << (x & 63);
+	}
+
+	int Count() const {
+		int n = 0;
+		for (uint64_t word : bits)
+			n += BitCount(word);
+		return n;
+	}
+};
+
+class ShadowCasting : public olc::PixelGameEngine {
+public:
+    ShadowCasting() {
+        sAppName = "ShadowCasting";
+        SetVisibilityThreads(1);
+    }
+
+    ~ShadowCasting() {
+        delete[] world;
+        delete sprLightCast;
+        delete sprLightmap;
+    }
+
+private: 
+	// Defining the array for the world and the size of it
+	sCell *world = nullptr;
+	int nWorldWidth = 40;
+	int nWorldHeight = 30;
+
+	// Defining the size of the block within cell
+	float fBlockWidth = 16.0f;
+
+	olc::Sprite *sprLightCast = nullptr;
+
+	// Where one light reaches, and the light of every light drawn this frame
+	sLightMask lightMask;
+	sLightAccumulator lightAccum;
+
+	// Colours given to the placed lights in turn
+	const olc::Pixel LightColours[5] = { olc::WHITE, olc::Pixel(255, 160, 64), olc::Pixel(64, 160, 255), olc::Pixel(255, 80, 160), olc::Pixel(128, 255, 96) };
+	int nNextLightColour = 0;
+
+	// Placed lights never move, so they are drawn into a lightmap once (B key)
+	// and only drawn again when a tile within reach of one of them changes.
+	// Lights whose polygon is out of date are flagged in vecLightDirty.
+	bool bBakeLights = true;
+	bool bLightmapDirty = true;
+	olc::Sprite *sprLightmap = nullptr;
+	sLightAccumulator bakedAccum;
+	vector<uint8_t> vecLightDirty;
+	int nLightsBaked = 0;
+
+	// The flagged lights, gathered into a batch for the bake
+	vector<sLight> vecBakeLights;
+	vector<int> vecBakeIds;
+	vector<vector<tuple<float, float, float>>> vecBakePolygons;
+
+	// Define the vector for the pool of edges
+	vector<sEdge> vecEdges;
+
+	// Slots of vecEdges emptied by UpdatePolyMapCell, reused before the pool grows
+	vector<int> vecFreeEdgeIds;
+
+	// Patch the PolyMap around toggled cells instead of converting it all again (I key)
+	bool bIncrementalPolyMap = true;
+
+	// Cast the brute force rays with CastRayEdges (V key)
+	bool bSimdRays = true;
+
+	// Uniform grid over the world, each bucket holding the ids of the edges touching it
+	float fEdgeGridCellSize = 64.0f;
+	int nEdgeGridWidth = 0;
+	int nEdgeGridHeight = 0;
+	vector<vector<int>> vecEdgeGrid;
+
+
+	vector<tuple<float, float, float>> vecVisibilityPolygonPoints;
+
+	// Reach of the lights placed and the mouse light (R key)
+	float fLightRadius = 1000.0f;
+
+	// Radius of the disc the lights placed and the mouse light give off,
+	// for soft shadows (S key), 0 for hard ones
+	float fLightSize = 8.0f;
+
+	// The blocks as bit rows, one bit per cell, for HasLineOfSight. Cells
+	// only change along with the PolyMap, so they are brought up to date
+	// when its generation has moved on.
+	vector<uint64_t> vecBlockRows;
+	int nBlockRowWords = 0;
+	uint32_t nBlockRowsGeneration = 0;
+	bool bBlockRowsValid = false;
+
+	// The tiles seen from the mouse's tile (F key), worked out on the grid
+	bool bShowTileVisibility = false;
+	sTileVisibility tileVisibility;
+
+	// Tiles any light has seen since the fog of war went on (G key); the
+	// rest are drawn dimmed. Placed lights only see more when the map
+	// changes, so only lights placed since, or all of them after a change,
+	// are looked from again. The mouse light is every frame.
+	bool bFogOfWar = false;
+	sTileVisibility tilesExplored;
+	uint32_t nFogGeneration = 0;
+	size_t nFogLights = 0;
+
+	// A row of a quadrant still to scan for CalculateTileVisibility: its
+	// distance from the viewer and the slopes (as fractions) of the open span
+	struct sFovRow {
+		int depth;
+		int startNum, startDen;
+		int endNum, endDen;
+	};
+	vector<sFovRow> vecFovRows;
+
+	// Rays cast by the rays engines, for the benchmark
+	atomic<size_t> nRaysTotal{ 0 };
+
+	// Corners the rays engines aimed at, and the edge ends they stand for.
+	// The mouse light's share of them, the last time it gathered its edges,
+	// is shown on the HUD.
+	atomic<size_t> nCornersTotal{ 0 }, nEdgeEndsTotal{ 0 };
+	size_t nMouseCorners = 0, nMouseEdgeEnds = 0;
+
+	// Lights placed in the world (L key), and a polygon buffer for each
+	vector<sLight> vecLights;
+	vector<vector<tuple<float, float, float>>> vecLightPolygons;
+
+	// Reuse the polygons of lights that haven't moved (K key). The PolyMap
+	// generation goes up on every change to the edges.
+	bool bVisibilityCache = true;
+	float fVisibilityCacheStep = 0.25f;
+	uint32_t nPolyMapGeneration = 0;
+	sVisibilityCache mouseLightCache;
+	vector<sVisibilityCache> vecLightCaches;
+	atomic<size_t> nCacheHits{ 0 }, nCacheMisses{ 0 };
+
+	// Stage timings of the last few hundred frames, shown with the P key
+	// and written out to profile.csv and profile.json with the O key
+	FrameProfiler profiler;
+	bool bShowProfiler = false;
+
+	// Algorithm used by CalculateVisibilityPolygon (cycled with the M key)
+	VisibilityEngine nVisibilityEngine = VIS_BRUTE_FORCE;
+
+	// Build the rays engines' offset rays and sort keys without atan2f/cosf/sinf (A key)
+	bool bTrigFreeRays = true;
+
+	void ConvertTileMapToPolyMap(int startX, int startY, int inputWidth, int inputHeigth, float fBlockWidth, int pitch) {
+		nPolyMapGeneration++;
+
+		// Clear "PolyMap"
+		vecEdges.clear();
+		vecFreeEdgeIds.clear();
+
+		for (int x = 0; x < inputWidth; x++)
+			for (int y = 0; y < inputHeigth; y++)
+				for (int j = 0; j < 4; j++)
+				{
+					world[(y + startY) * pitch + (x + startX)].edge_exist[j] = false;
+					world[(y + startY) * pitch + (x + startX)].edge_id[j] = 0;
+				}
+
+		// Iterate through region from top left to bottom right
+		for (int x = 1; x < inputWidth - 1; x++)
+			for (int y = 1; y < inputHeigth - 1; y++)
+			{
+				// Create some convenient indices
+				int i = (y + startY) * pitch + (x + startX);		// This
+				int n = (y + startY - 1) * pitch + (x + startX);	// Northern Neighbour
+				int s = (y + startY + 1) * pitch + (x + startX);	// Southern Neighbour
+				int w = (y + startY) * pitch + (x + startX - 1);	// Western Neighbour
+				int e = (y + startY) * pitch + (x + startX + 1);	// Eastern Neighbour
+
+				// If this cell exists, check if it needs edges
+				if (world[i].exist)
+				{
+					// If this cell has no western neighbour, it needs a western edge
+					if (!world[w].exist)
+					{
+						// It can either extend it from its northern neighbour if they have
+						// one, or It can start a new one.
+						if (world[n].edge_exist[WEST])
+						{
+							// Northern neighbour has a western edge, so grow it downwards
+							vecEdges[world[n].edge_id[WEST]].endY += fBlockWidth;
+							world[i].edge_id[WEST] = world[n].edge_id[WEST];
+							world[i].edge_exist[WEST] = true;
+						}
+						else
+						{
+							// Northern neighbour does not have one, so create one
+							sEdge edge;
+							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
+							edge.endX = edge.startX; edge.endY = edge.startY + fBlockWidth;
+
+							// Add edge to Polygon Pool
+							int edge_id = vecEdges.size();
+							vecEdges.push_back(edge);
+
+							// Update tile information with edge information
+							world[i].edge_id[WEST] = edge_id;
+							world[i].edge_exist[WEST] = true;
+						}
+					}
+
+					// If this cell dont have an eastern neignbour, It needs a eastern edge
+					if (!world[e].exist)
+					{
+						// It can either extend it from its northern neighbour if they have
+						// one, or It can start a new one.
+						if (world[n].edge_exist[EAST])
+						{
+							// Northern neighbour has one, so grow it downwards
+							vecEdges[world[n].edge_id[EAST]].endY += fBlockWidth;
+							world[i].edge_id[EAST] = world[n].edge_id[EAST];
+							world[i].edge_exist[EAST] = true;
+						}
+						else
+						{
+							// Northern neighbour does not have one, so create one
+							sEdge edge;
+							edge.startX = (startX + x + 1) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
+							edge.endX = edge.startX; edge.endY = edge.startY + fBlockWidth;
+
+							// Add edge to Polygon Pool
+							int edge_id = vecEdges.size();
+							vecEdges.push_back(edge);
+
+							// Update tile information with edge information
+							world[i].edge_id[EAST] = edge_id;
+							world[i].edge_exist[EAST] = true;
+						}
+					}
+
+					// If this cell doesnt have a northern neignbour, It needs a northern edge
+					if (!world[n].exist)
+					{
+						// It can either extend it from its western neighbour if they have
+						// one, or It can start a new one.
+						if (world[w].edge_exist[NORTH])
+						{
+							// Western neighbour has one, so grow it eastwards
+							vecEdges[world[w].edge_id[NORTH]].endX += fBlockWidth;
+							world[i].edge_id[NORTH] = world[w].edge_id[NORTH];
+							world[i].edge_exist[NORTH] = true;
+						}
+						else
+						{
+							// Western neighbour does not have one, so create one
+							sEdge edge;
+							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
+							edge.endX = edge.startX + fBlockWidth; edge.endY = edge.startY;
+
+							// Add edge to Polygon Pool
+							int edge_id = vecEdges.size();
+							vecEdges.push_back(edge);
+
+							// Update tile information with edge information
+							world[i].edge_id[NORTH] = edge_id;
+							world[i].edge_exist[NORTH] = true;
+						}
+					}
+
+					// If this cell doesnt have a southern neignbour, It needs a southern edge
+					if (!world[s].exist)
+					{
+						// It can either extend it from its western neighbour if they have
+						// one, or It can start a new one.
+						if (world[w].edge_exist[SOUTH])
+						{
+							// Western neighbour has one, so grow it eastwards
+							vecEdges[world[w].edge_id[SOUTH]].endX += fBlockWidth;
+							world[i].edge_id[SOUTH] = world[w].edge_id[SOUTH];
+							world[i].edge_exist[SOUTH] = true;
+						}
+						else
+						{
+							// Western neighbour does not have one, so I need to create one
+							sEdge edge;
+							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y + 1) * fBlockWidth;
+							edge.endX = edge.startX + fBlockWidth; edge.endY = edge.startY;
+
+							// Add edge to Polygon Pool
+							int edge_id = vecEdges.size();
+							vecEdges.push_back(edge);
+
+							// Update tile information with edge information
+							world[i].edge_id[SOUTH] = edge_id;
+							world[i].edge_exist[SOUTH] = true;
+						}
+					}
+
+				}
+
+			}
+
+		// Bucket the new edges for ray queries
+		BuildEdgeGrid();
+	}
+
+	// Call f(bucket) for every grid bucket the edge touches. Edges are slightly
+	// grown first, so one lying on a bucket border is found from both sides.
+	template<typename F>
+	void ForEachEdgeGridCell(const sEdge &edge, F f) {
+		int x0 = max(0, (int)floorf((min(edge.startX, edge.endX) - 0.5f) / fEdgeGridCellSize));
+		int y0 = max(0, (int)floorf((min(edge.startY, edge.endY) - 0.5f) / fEdgeGridCellSize));
+		int x1 = min(nEdgeGridWidth - 1, (int)floorf((max(edge.startX, edge.endX) + 0.5f) / fEdgeGridCellSize));
+		int y1 = min(nEdgeGridHeight - 1, (int)floorf((max(edge.startY, edge.endY) + 0.5f) / fEdgeGridCellSize));
+
+		for (int y = y0; y <= y1; y++)
+			for (int x = x0; x <= x1; x++)
+				f(vecEdgeGrid[y * nEdgeGridWidth + x]);
+	}
+
+	void IndexEdge(int edge_id) {
+		ForEachEdgeGridCell(vecEdges[edge_id], [&](vector<int> &bucket) { bucket.push_back(edge_id); });
+	}
+
+	void UnindexEdge(int edge_id) {
+		ForEachEdgeGridCell(vecEdges[edge_id], [&](vector<int> &bucket)
+		{
+			auto it = find(bucket.begin(), bucket.end(), edge_id);
+			if (it != bucket.end())
+			{
+				*it = bucket.back();
+				bucket.pop_back();
+			}
+		});
+	}
+
+	void BuildEdgeGrid() {
+		nEdgeGridWidth = (int)ceilf(nWorldWidth * fBlockWidth / fEdgeGridCellSize);
+		nEdgeGridHeight = (int)ceilf(nWorldHeight * fBlockWidth / fEdgeGridCellSize);
+
+		vecEdgeGrid.resize(nEdgeGridWidth * nEdgeGridHeight);
+		for (auto &bucket : vecEdgeGrid)
+			bucket.clear();
+
+		for (int e = 0; e < (int)vecEdges.size(); e++)
+			if (!IsEdgeEmpty(vecEdges[e]))
+				IndexEdge(e);
+	}
+
+	// A free slot in the edge pool is collapsed to a single point, which
+	// no ray can ever hit
+	static bool IsEdgeEmpty(const sEdge &edge) {
+		return edge.startX == edge.endX && edge.startY == edge.endY;
+	}
+
+	int AllocateEdge(const sEdge &edge) {
+		if (vecFreeEdgeIds.empty())
+		{
+			vecEdges.push_back(edge);
+			return vecEdges.size() - 1;
+		}
+
+		int edge_id = vecFreeEdgeIds.back();
+		vecFreeEdgeIds.pop_back();
+		vecEdges[edge_id] = edge;
+		return edge_id;
+	}
+
+	void FreeEdge(int edge_id) {
+		UnindexEdge(edge_id);
+		vecEdges[edge_id].endX = vecEdges[edge_id].startX;
+		vecEdges[edge_id].endY = vecEdges[edge_id].startY;
+		vecFreeEdgeIds.push_back(edge_id);
+	}
+
+	// Rebuild the edges on one side of a line of cells (a column for western
+	// and eastern edges, a row for northern and southern ones) passing through
+	// the given cell. Only the stretch of cells joined to it by an edge is touched.
+	void RebuildPolyMapLine(int side, int cellX, int cellY, int startX, int startY, int inputWidth, int inputHeigth, float fBlockWidth, int pitch) {
+		nPolyMapGeneration++;
+
+		// Like ConvertTileMapToPolyMap, the outer ring of the region never has edges
+		auto inside = [&](int x, int y)
+		{
+			return x > startX && x < startX + inputWidth - 1 && y > startY && y < startY + inputHeigth - 1;
+		};
+
+		if (!inside(cellX, cellY))
+			return;
+
+		// Western and eastern edges grow southwards, northern and southern ones eastwards
+		bool vertical = side == WEST || side == EAST;
+		int stepX = vertical ? 0 : 1;
+		int stepY = vertical ? 1 : 0;
+
+		// Offset to the neighbour whose absence makes this side an edge
+		int nx = side == WEST ? -1 : (side == EAST ? 1 : 0);
+		int ny = side == NORTH ? -1 : (side == SOUTH ? 1 : 0);
+
+		// Extend the stretch over every neighbouring cell sharing an edge with it
+		int x0 = cellX, y0 = cellY, x1 = cellX, y1 = cellY;
+		while (inside(x0 - stepX, y0 - stepY) && world[(y0 - stepY) * pitch + (x0 - stepX)].edge_exist[side]) { x0 -= stepX; y0 -= stepY; }
+		while (inside(x1 + stepX, y1 + stepY) && world[(y1 + stepY) * pitch + (x1 + stepX)].edge_exist[side]) { x1 += stepX; y1 += stepY; }
+
+		// Remove the old edges along the stretch
+		for (int x = x0, y = y0; x <= x1 && y <= y1; x += stepX, y += stepY)
+		{
+			sCell &cell = world[y * pitch + x];
+			if (cell.edge_exist[side] && !IsEdgeEmpty(vecEdges[cell.edge_id[side]]))
+				FreeEdge(cell.edge_id[side]);
+			cell.edge_exist[side] = false;
+			cell.edge_id[side] = 0;
+		}
+
+		// And extract them again, growing an edge for as long as cells need one.
+		// The cells either side of the stretch have no edge here, so nothing outside
+		// of it needs merging. Edges go into the grid once they are fully grown.
+
+		int edge_id = -1;
+		for (int x = x0, y = y0; x <= x1 && y <= y1; x += stepX, y += stepY)
+		{
+			sCell &cell = world[y * pitch + x];
+			if (!cell.exist || world[(y + ny) * pitch + (x + nx)].exist)
+			{
+				if (edge_id != -1)
+					IndexEdge(edge_id);
+				edge_id = -1;
+				continue;
+			}
+
+			if (edge_id == -1)
+			{
+				sEdge edge;
+				edge.startX = (x + (side == EAST ? 1 : 0)) * fBlockWidth;
+				edge.startY = (y + (side == SOUTH ? 1 : 0)) * fBlockWidth;
+				edge.endX = edge.startX + stepX * fBlockWidth;
+				edge.endY = edge.startY + stepY * fBlockWidth;
+				edge_id = AllocateEdge(edge);
+			}
+			else
+			{
+				vecEdges[edge_id].endX += stepX * fBlockWidth;
+				vecEdges[edge_id].endY += stepY * fBlockWidth;
+			}
+
+			cell.edge_id[side] = edge_id;
+			cell.edge_exist[side] = true;
+		}
+
+		if (edge_id != -1)
+			IndexEdge(edge_id);
+	}
+
+	// Patch the PolyMap after the cell (cellX, cellY) has been toggled. Toggling a
+	// cell only changes which sides of it and its 4 neighbours need an edge, so
+	// only the lines through those sides are rebuilt. Ids of untouched edges stay
+	// the same.
+	void UpdatePolyMapCell(int cellX, int cellY, int startX, int startY, int inputWidth, int inputHeigth, float fBlockWidth, int pitch) {
+		RebuildPolyMapLine(NORTH, cellX, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(SOUTH, cellX, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(EAST, cellX, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(WEST, cellX, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+
+		RebuildPolyMapLine(SOUTH, cellX, cellY - 1, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(NORTH, cellX, cellY + 1, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(EAST, cellX - 1, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+		RebuildPolyMapLine(WEST, cellX + 1, cellY, startX, startY, inputWidth, inputHeigth, fBlockWidth, pitch);
+	}
+
+	// Test a ray from the origin along (rdx, rdy) against a single edge. If it
+	// hits, t1 is the distance along the ray in units of its length.
+	static bool IntersectRayEdge(const sEdge &edge, float originX, float originY, float rdx, float rdy, float &t1) {
+		// Create line segment vector
+		float sdx = edge.endX - edge.startX;
+		float sdy = edge.endY - edge.startY;
+
+		if (fabs(sdx - rdx) > 0.0f && fabs(sdy - rdy) > 0.0f)
+		{
+			// t2 is normalised distance from line segment start to line segment end of intersect point
+			float t2 = (rdx * (edge.startY - originY) + (rdy * (originX - edge.startX))) / (sdx * rdy - sdy * rdx);
+			// t1 is normalised distance from source along ray to ray length of intersect point
+			t1 = (edge.startX + sdx * t2 - originX) / rdx;
+
+			// If intersect point exists along ray, and along line 
+			// segment then intersect point is valid
+			return t1 > 0 && t2 >= 0 && t2 <= 1.0f;
+		}
+
+		return false;
+	}
+
+	// Find the closest edge hit by a ray by checking it against every edge
+	bool CastRayBruteForce(const vector<sEdge> &edges, float originX, float originY, float rdx, float rdy, float &min_px, float &min_py) {
+		float min_t1 = INFINITY;
+		bool bValid = false;
+
+		// Check for ray intersection with all edges
+		for (auto &edge : edges)
+		{
+			float t1;
+			// Check if this intersect point is closest to source. If
+			// it is, then store this point and reject others
+			if (IntersectRayEdge(edge, originX, originY, rdx, rdy, t1) && t1 < min_t1)
+			{
+				min_t1 = t1;
+				min_px = originX + rdx * t1;
+				min_py = originY + rdy * t1;
+				bValid = true;
+			}
+		}
+
+		return bValid;
+	}
+
+	// Same as CastRayBruteForce, 8 (or 4) edges at a time from the SoA store
+	bool CastRaySimd(const sEdgeSoA &soa, float originX, float originY, float rdx, float rdy, float &min_px, float &min_py) {
+		float min_t1 = CastRayEdges(soa, originX, originY, rdx, rdy);
+		if (min_t1 == INFINITY)
+			return false;
+
+		min_px = originX + rdx * min_t1;
+		min_py = originY + rdy * min_t1;
+		return true;
+	}
+
+	// Find the closest edge hit by a ray by walking the grid buckets it crosses,
+	// nearest first, and stopping at the first bucket holding a hit. The ray is
+	// not followed past the sides of the light's polygon, which it hits if
+	// nothing else is in the way.
+	bool CastRayEdgeGrid(float originX, float originY, float rdx, float rdy, float &min_px, float &min_py) {
+		float fGridWidth = nEdgeGridWidth * fEdgeGridCellSize;
+		float fGridHeight = nEdgeGridHeight * fEdgeGridCellSize;
+
+		// Rays are as long as the radius, so they leave the polygon at the side
+		// facing them most, before t = 1
+		float fFacing = 0.0f;
+		for (int k = 0; k < LIGHT_SIDES; k++)
+			fFacing = max(fFacing, LightSideNormals()[k].first * rdx + LightSideNormals()[k].second * rdy);
+		float t_side = min(1.0f, sqrtf(rdx * rdx + rdy * rdy) * LightSideDistance() / fFacing);
+
+		// Clip the ray to the grid, in case the source is outside of it
+		float t_enter = 0.0f, t_leave = t_side;
+		if (rdx != 0.0f)
+		{
+			float ta = (0.0f - originX) / rdx, tb = (fGridWidth - originX) / rdx;
+			t_enter = max(t_enter, min(ta, tb)); t_leave = min(t_leave, max(ta, tb));
+		}
+		else if (originX < 0.0f || originX >= fGridWidth) t_leave = -1.0f;
+		if (rdy != 0.0f)
+		{
+			float ta = (0.0f - originY) / rdy, tb = (fGridHeight - originY) / rdy;
+			t_enter = max(t_enter, min(ta, tb)); t_leave = min(t_leave, max(ta, tb));
+		}
+		else if (originY < 0.0f || originY >= fGridHeight) t_leave = -1.0f;
+
+		float min_t1 = t_enter > t_leave ? INFINITY : WalkEdgeGrid(originX, originY, rdx, rdy, t_enter, t_leave);
+		min_t1 = min(min_t1, t_side);
+
+		min_px = originX + rdx * min_t1;
+		min_py = originY + rdy * min_t1;
+		return true;
+	}
+
+	// The closest hit along the ray over the buckets it crosses in [t_enter, t_leave]
+	float WalkEdgeGrid(float originX, float originY, float rdx, float rdy, float t_enter, float t_leave) {
+		// Starting bucket and DDA stepping (Amanatides & Woo)
+		int cx = min(nEdgeGridWidth - 1, max(0, (int)((originX + rdx * t_enter) / fEdgeGridCellSize)));
+		int cy = min(nEdgeGridHeight - 1, max(0, (int)((originY + rdy * t_enter) / fEdgeGridCellSize)));
+		int stepX = rdx > 0.0f ? 1 : -1;
+		int stepY = rdy > 0.0f ? 1 : -1;
+		float tMaxX = rdx != 0.0f ? ((cx + (stepX > 0 ? 1 : 0)) * fEdgeGridCellSize - originX) / rdx : INFINITY;
+		float tMaxY = rdy != 0.0f ? ((cy + (stepY > 0 ? 1 : 0)) * fEdgeGridCellSize - originY) / rdy : INFINITY;
+		float tDeltaX = rdx != 0.0f ? fEdgeGridCellSize / fabs(rdx) : INFINITY;
+		float tDeltaY = rdy != 0.0f ? fEdgeGridCellSize / fabs(rdy) : INFINITY;
+
+		float min_t1 = INFINITY;
+		while (true)
+		{
+			for (int edge_id : vecEdgeGrid[cy * nEdgeGridWidth + cx])
+			{
+				float t1;
+				if (IntersectRayEdge(vecEdges[edge_id], originX, originY, rdx, rdy, t1) && t1 < min_t1)
+					min_t1 = t1;
+			}
+
+			// A hit inside this bucket can't be beaten by anything further along
+			float t_exit = min(tMaxX, tMaxY);
+			if (min_t1 <= t_exit || t_exit > t_leave)
+				break;
+
+			if (tMaxX < tMaxY) { cx += stepX; tMaxX += tDeltaX; }
+			else { cy += stepY; tMaxY += tDeltaY; }
+
+			if (cx < 0 || cx >= nEdgeGridWidth || cy < 0 || cy >= nEdgeGridHeight)
+				break;
+		}
+
+		return min_t1;
+	}
+
+	// How far along the ray, in pixels, the first edge of the PolyMap is, or
+	// the ray's length for none. Walks the edge grid whichever engine is on.
+	float WallDistance(float originX, float originY, float rdx, float rdy) {
+		float min_px, min_py;
+		CastRayEdgeGrid(originX, originY, rdx, rdy, min_px, min_py);
+		return hypotf(min_px - originX, min_py - originY);
+	}
+
+	// Visibility from rays cast at (and either side of) every edge endpoint near the light
+	void CalculateVisibilityPolygonRays(const sLight &light, const sLightEdges &local, vector<tuple<float, float, float>> &vecPoints) {
+		// Get rid of existing polygon
+		vecPoints.clear();
+
+		CastRaysAtEndpoints(light, local, 0, local.vecEndpoints.size(), vecPoints);
+		SortPolygonPoints(vecPoints);
+	}
+
+	// Sort perimeter points by angle from source. This will allow
+	// us to draw a triangle fan.
+	static void SortPolygonPoints(vector<tuple<float, float, float>> &vecPoints) {
+		sort(
+			vecPoints.begin(),
+			vecPoints.end(),
+			[&](const tuple<float, float, float> &t1, const tuple<float, float, float> &t2)
+			{
+				return get<0>(t1) < get<0>(t2);
+			});
+	}
+
+	// Add the hits of the rays aimed at endpoints [first, last) of the light's
+	// edges to vecPoints, unsorted
+	void CastRaysAtEndpoints(const sLight &light, const sLightEdges &local, size_t first, size_t last, vector<tuple<float, float, float>> &vecPoints) {
+		float originX = light.x, originY = light.y, radius = light.radius;
+		nRaysTotal.fetch_add(3 * (last - first), memory_order_relaxed);
+
+		// The offset rays are the direct one turned by this much either way
+		const float fRayOffset = 0.0001f;
+		static const float fRayOffsetCos = cosf(fRayOffset);
+		static const float fRayOffsetSin = sinf(fRayOffset);
+
+		// For each endpoint near the light. Free slots of the edge pool were
+		// left out, the inner loop doesn't need to check for them either as a
+		// zero length edge can never produce a valid t2.
+		for (size_t e = first; e < last; e++)
+		{
+			const pair<float, float> &endpoint = local.vecEndpoints[e];
+			float rdx, rdy;
+			rdx = endpoint.first - originX;
+			rdy = endpoint.second - originY;
+
+			// Unit direction at the point, for rotating in the trig free mode
+			float ux = 0, uy = 0, base_ang = 0;
+			if (bTrigFreeRays)
+			{
+				float len = sqrtf(rdx * rdx + rdy * rdy);
+				ux = len > 0.0f ? rdx / len : 1.0f;
+				uy = len > 0.0f ? rdy / len : 0.0f;
+			}
+			else
+				base_ang = atan2f(rdy, rdx);
+
+			float ang = 0;
+			// For each point, cast 3 rays, 1 directly at point
+			// and 1 a little bit either side
+			for (int j = 0; j < 3; j++)
+			{
+				if (bTrigFreeRays)
+				{
+					// Rotate the unit direction by -offset, 0 or +offset
+					float s = (j - 1) * fRayOffsetSin;
+					float c = j == 1 ? 1.0f : fRayOffsetCos;
+					rdx = radius * (ux * c - uy * s);
+					rdy = radius * (ux * s + uy * c);
+				}
+				else
+				{
+					if (j == 0)	ang = base_ang - fRayOffset;
+					if (j == 1)	ang = base_ang;
+					if (j == 2)	ang = base_ang + fRayOffset;
+
+					// Create ray along angle for required distance
+					rdx = radius * cosf(ang);
+					rdy = radius * sinf(ang);
+				}
+
+				// Find the closest edge the ray hits
+				float min_px = 0, min_py = 0;
+				bool bValid = nVisibilityEngine == VIS_EDGE_GRID ?
+					CastRayEdgeGrid(originX, originY, rdx, rdy, min_px, min_py) :
+					bSimdRays ?
+					CastRaySimd(local.soa, originX, originY, rdx, rdy, min_px, min_py) :
+					CastRayBruteForce(local.vecEdges, originX, originY, rdx, rdy, min_px, min_py);
+
+				if (bValid)// Add intersection point to visibility polygon perimeter
+				{
+					float min_ang = bTrigFreeRays ?
+						PseudoAngle(min_py - originY, min_px - originX) :
+						atan2f(min_py - originY, min_px - originX);
+					vecPoints.push_back({ min_ang, min_px, min_py });
+				}
+			}
+		}
+	}
+
+	// Is the point (px, py) on the left hand side of the line through the edge?
+	static bool IsLeftOf(const sEdge &edge, float px, float py) {
+		return (edge.endX - edge.startX) * (py - edge.startY) - (edge.endY - edge.startY) * (px - edge.startX) < 0.0f;
+	}
+
+	// Does edge a hide edge b from the origin? Only meaningful for edges that
+	// don't cross and overlap in angle, which is always true for the PolyMap.
+	static bool IsEdgeInFront(const sEdge &a, const sEdge &b, float originX, float originY) {
+		// Sample each edge slightly inside its ends so shared corners don't count
+		bool a1 = IsLeftOf(a, b.startX + (b.endX - b.startX) * 0.01f, b.startY + (b.endY - b.startY) * 0.01f);
+		bool a2 = IsLeftOf(a, b.endX + (b.startX - b.endX) * 0.01f, b.endY + (b.startY - b.endY) * 0.01f);
+		bool a3 = IsLeftOf(a, originX, originY);
+		bool b1 = IsLeftOf(b, a.startX + (a.endX - a.startX) * 0.01f, a.startY + (a.endY - a.startY) * 0.01f);
+		bool b2 = IsLeftOf(b, a.endX + (a.startX - a.endX) * 0.01f, a.endY + (a.startY - a.endY) * 0.01f);
+		bool b3 = IsLeftOf(b, originX, originY);
+
+		// a lies entirely on the origin's side of b
+		if (b1 == b2 && b2 == b3) return true;
+		// b lies entirely on the far side of a
+		if (a1 == a2 && a2 != a3) return true;
+		return false;
+	}
+
+	// Orders edge ids in the active set, nearest to the origin first
+	struct sSweepOrder {
+		const vector<sEdge> *edges;
+		float originX, originY;
+
+		bool operator()(int a, int b) const {
+			if (a == b) return false;
+			if (IsEdgeInFront((*edges)[a], (*edges)[b], originX, originY)) return true;
+			if (IsEdgeInFront((*edges)[b], (*edges)[a], originX, originY)) return false;
+			return a < b;
+		}
+	};
+
+	// Allocator for the nodes of the active edge set. Freed nodes are kept in
+	// a list and handed out again, so once a thread has swept a few lights its
+	// set no longer goes to the heap. All nodes of a set have the same size.
+	template<typename T>
+	struct sNodeRecycler {
+		typedef T value_type;
+		vector<void *> *pFree;
+
+		sNodeRecycler(vector<void *> *pFree) : pFree(pFree) {}
+		template<typename U> sNodeRecycler(const sNodeRecycler<U> &other) : pFree(other.pFree) {}
+
+		T *allocate(size_t n) {
+			if (n != 1 || pFree->empty())
+				return (T *)::operator new(n * sizeof(T));
+			void *p = pFree->back();
+			pFree->pop_back();
+			return (T *)p;
+		}
+
+		void deallocate(T *p, size_t n) {
+			if (n == 1) pFree->push_back(p);
+			else ::operator delete(p);
+		}
+
+		template<typename U> bool operator==(const sNodeRecycler<U> &other) const { return pFree == other.pFree; }
+		template<typename U> bool operator!=(const sNodeRecycler<U> &other) const { return pFree != other.pFree; }
+	};
+
+	typedef set<int, sSweepOrder, sNodeRecycler<int>> ActiveEdgeSet;
+
+	// Working memory of the visibility engines, kept from one light to the
+	// next so it stops allocating once it has grown. Each thread has its own.
+	struct sVisibilityScratch {
+		vector<sSweepEvent> vecEvents;
+		vector<ActiveEdgeSet::iterator> vecActiveIt;
+		vector<void *> vecFreeNodes;
+
+		// The edges around the light being worked on, and what gathering
+		// them takes: a stamp per edge so ones in several grid buckets are
+		// only taken once, and the chunk stitching for a ChunkedWorld
+		sLightEdges local;
+		vector<uint32_t> vecEdgeStamp;
+		uint32_t nStamp = 0;
+		ChunkedWorld::sGatherScratch gather;
+
+		sVisibilityScratch() = default;
+		sVisibilityScratch(sVisibilityScratch &&) = default;
+		~sVisibilityScratch() {
+			for (void *p : vecFreeNodes)
+				::operator delete(p);
+		}
+	};
+
+	// Threads sharing the visibility work (T key), each with its own scratch
+	// memory and a buffer for its part of a split light
+	ThreadPool threadPool;
+	vector<sVisibilityScratch> vecThreadScratch;
+	vector<vector<tuple<float, float, float>>> vecSplitPoints;
+
+	// The edges of the light being split, shared by all the threads
+	sLightEdges splitEdges;
+
+	// Maps with at least this many edges have single lights split between threads
+	int nSplitLightEdges = 2000;
+
+	// Sweep the angles [fFromAngle, fToAngle) around the light, over the given
+	// edges. Sweeping every angle gives the whole polygon, a smaller range gives
+	// the part of it in that sector, so a light can be split between threads.
+	void CalculateVisibilityPolygonSweep(const vector<sEdge> &edges, const sLight &light, sVisibilityScratch &scratch, vector<tuple<float, float, float>> &vecPoints,
+		float fFromAngle = -3.14159265f, float fToAngle = INFINITY) {
+		float originX = light.x, originY = light.y;
+
+		// Get rid of existing polygon
+		vecPoints.clear();
+
+		// Each edge becomes visible to the sweep at one end and stops being
+		// visible at the other. Edges pointing straight at the source (and
+		// free slots) cover no angle at all and can never hide anything, so
+		// they are skipped.
+		vector<sSweepEvent> &vecEvents = scratch.vecEvents;
+		vecEvents.clear();
+
+		ActiveEdgeSet setActive(sSweepOrder{ &edges, originX, originY }, sNodeRecycler<int>(&scratch.vecFreeNodes));
+		vector<ActiveEdgeSet::iterator> &vecActiveIt = scratch.vecActiveIt;
+		vecActiveIt.assign(edges.size(), setActive.end());
+
+		for (int e = 0; e < (int)edges.size(); e++)
+		{
+			const sEdge &edge = edges[e];
+			float sdx = edge.startX - originX, sdy = edge.startY - originY;
+			float edx = edge.endX - originX, edy = edge.endY - originY;
+
+			float cross = sdx * edy - sdy * edx;
+			if (cross == 0.0f)
+				continue;
+
+			float start_ang = atan2f(sdy, sdx);
+			float end_ang = atan2f(edy, edx);
+
+			// Sweep runs with increasing angle, so begin at whichever end comes first
+			sSweepEvent begin = { start_ang, edge.startX, edge.startY, e, true };
+			sSweepEvent finish = { end_ang, edge.endX, edge.endY, e, false };
+			if (cross < 0.0f)
+			{
+				begin = { end_ang, edge.endX, edge.endY, e, true };
+				finish = { start_ang, edge.startX, edge.startY, e, false };
+			}
+			if (begin.angle >= fFromAngle && begin.angle < fToAngle)
+				vecEvents.push_back(begin);
+			if (finish.angle >= fFromAngle && finish.angle < fToAngle)
+				vecEvents.push_back(finish);
+
+			// Edges already under the sweep where it starts go straight in the set.
+			// When sweeping all the way round from -PI, those are the ones wrapping
+			// around it.
+			bool bWraps = begin.angle > finish.angle;
+			bool bVisible = bWraps ?
+				(fFromAngle > begin.angle || fFromAngle <= finish.angle) :
+				(fFromAngle > begin.angle && fFromAngle <= finish.angle);
+			if (bVisible)
+				vecActiveIt[e] = setActive.insert(e).first;
+		}
+
+		sort(vecEvents.begin(), vecEvents.end(),
+			[](const sSweepEvent &e1, const sSweepEvent &e2) { return e1.angle < e2.angle; });
+
+		// Find where a ray from the source through (rdx, rdy) hits an edge
+		auto hit = [&](int edge_id, float rdx, float rdy)
+		{
+			const sEdge &edge = edges[edge_id];
+			float sdx = edge.endX - edge.startX;
+			float sdy = edge.endY - edge.startY;
+			float t2 = (rdx * (edge.startY - originY) + (rdy * (originX - edge.startX))) / (sdx * rdy - sdy * rdx);
+			t2 = max(0.0f, min(1.0f, t2));
+			return make_pair(edge.startX + sdx * t2, edge.startY + sdy * t2);
+		};
+
+		size_t i = 0;
+		while (i < vecEvents.size())
+		{
+			float ang = vecEvents[i].angle;
+
+			// Ray straight at the endpoint, no need for cosf/sinf
+			float rdx = vecEvents[i].x - originX;
+			float rdy = vecEvents[i].y - originY;
+
+			// Nearest edge just before this angle
+			int nearest_before = setActive.empty() ? -1 : *setActive.begin();
+
+			// Apply every event at this angle, removals first so edges meeting
+			// at a corner are never in the set together
+			size_t j = i;
+			for (; j < vecEvents.size() && vecEvents[j].angle == ang; j++)
+				if (!vecEvents[j].begin && vecActiveIt[vecEvents[j].edge_id] != setActive.end())
+				{
+					setActive.erase(vecActiveIt[vecEvents[j].edge_id]);
+					vecActiveIt[vecEvents[j].edge_id] = setActive.end();
+				}
+			for (size_t k = i; k < j; k++)
+				if (vecEvents[k].begin)
+					vecActiveIt[vecEvents[k].edge_id] = setActive.insert(vecEvents[k].edge_id).first;
+			i = j;
+
+			// Nearest edge just after this angle
+			int nearest_after = setActive.empty() ? -1 : *setActive.begin();
+
+			// If the nearest edge changes here the polygon steps between
+			// the two, otherwise the endpoint is hidden or sits on the wall
+			if (nearest_before != -1)
+			{
+				auto p = hit(nearest_before, rdx, rdy);
+				vecPoints.push_back({ ang, p.first, p.second });
+			}
+			if (nearest_after != -1 && nearest_after != nearest_before)
+			{
+				auto p = hit(nearest_after, rdx, rdy);
+				vecPoints.push_back({ ang, p.first, p.second });
+			}
+		}
+	}
+
+	// Symmetric shadowcasting on the cell grid: the tiles seen from the
+	// middle of tile (originX, originY) within nRadius tiles, into vis, which
+	// is resized to the world. With bKeep the tiles are added to those vis
+	// already holds, if it is the right size. Each quadrant is scanned row by row away from
+	// the viewer, the open spans of a row carrying on into the next as pairs
+	// of slopes. Blocks are seen when any of them is in a span, floor only
+	// when its centre is, which makes it symmetric: A sees B when B sees A.
+	// Works from the cells alone, never the PolyMap.
+	void CalculateTileVisibility(int originX, int originY, int nRadius, sTileVisibility &vis, bool bKeep = false) {
+		if (vis.width != nWorldWidth || vis.height != nWorldHeight)
+			vis.Resize(nWorldWidth, nWorldHeight);
+		else if (!bKeep)
+			vis.Clear();
+		if (originX < 0 || originY < 0 || originX >= nWorldWidth || originY >= nWorldHeight)
+			return;
+		vis.Set(originX, originY);
+
+		// Rounding of depth * num / den, halves up and halves down
+		auto floorDiv = [](int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+		auto roundUp = [&](int depth, int num, int den) { return floorDiv(2 * depth * num + den, 2 * den); };
+		auto roundDown = [&](int depth, int num, int den) { return -floorDiv(-(2 * depth * num - den), 2 * den); };
+
+		const int nRange = nRadius * nRadius + nRadius;
+		for (int quadrant = 0; quadrant < 4; quadrant++)
+		{
+			vecFovRows.clear();
+			vecFovRows.push_back({ 1, -1, 1, 1, 1 });
+			while (!vecFovRows.empty())
+			{
+				sFovRow row = vecFovRows.back();
+				vecFovRows.pop_back();
+				if (row.depth > nRadius)
+					continue;
+
+				// -1 before the first tile, then whether the last tile was a block
+				int nPrevBlock = -1;
+				int colStart = roundUp(row.depth, row.startNum, row.startDen);
+				int colEnd = roundDown(row.depth, row.endNum, row.endDen);
+				for (int col = colStart; col <= colEnd; col++)
+				{
+					int x = originX, y = originY;
+					switch (quadrant)
+					{
+					case NORTH: x += col; y -= row.depth; break;
+					case SOUTH: x += col; y += row.depth; break;
+					case EAST:  x += row.depth; y += col; break;
+					case WEST:  x -= row.depth; y += col; break;
+					}
+
+					// Outside the world counts as blocks
+					bool bInside = x >= 0 && y >= 0 && x < nWorldWidth && y < nWorldHeight;
+					bool bBlock = !bInside || world[y * nWorldWidth + x].exist;
+
+					bool bCentreInSpan = col * row.startDen >= row.depth * row.startNum && col * row.endDen <= row.depth * row.endNum;
+					if (bInside && col * col + row.depth * row.depth <= nRange && (bBlock || bCentreInSpan))
+						vis.Set(x, y);
+
+					// A span opens after a block and closes before one
+					if (nPrevBlock == 1 && !bBlock)
+					{
+						row.startNum = 2 * col - 1;
+						row.startDen = 2 * row.depth;
+					}
+					if (nPrevBlock == 0 && bBlock)
+						vecFovRows.push_back({ row.depth + 1, row.startNum, row.startDen, 2 * col - 1, 2 * row.depth });
+					nPrevBlock = bBlock;
+				}
+
+				if (nPrevBlock == 0)
+					vecFovRows.push_back({ row.depth + 1, row.startNum, row.startDen, row.endNum, row.endDen });
+			}
+		}
+	}
+
+	// Line of sight for a batch of segments, in pixels: bit i of
+	// result[i / 64] is set when segment i misses every block. Only reads
+	// the cells, so the words of the result are shared out between threads.
+	void HasLineOfSight(const sSightLine *lines, int nLines, vector<uint64_t> &result) {
+		UpdateBlockRows();
+
+		int nWords = (nLines + 63) / 64;
+		result.assign(nWords, 0);
+		threadPool.ParallelFor(nWords, [&](int w, int)
+		{
+			int first = w * 64;
+			int count = min(64, nLines - first);
+			uint64_t bits = 0;
+			for (int i = 0; i < count; i++)
+				bits |= uint64_t(IsSegmentClear(lines[first + i])) << i;
+			result[w] = bits;
+		});
+	}
+
+	// Whether a segment misses every block. It is followed a row of cells at
+	// a time, the stretch of the row it crosses being one mask test per 64
+	// cells. Leaving the world counts as blocked.
+	bool IsSegmentClear(const sSightLine &line) const {
+		float ax = line.ax / fBlockWidth, ay = line.ay / fBlockWidth;
+		float bx = line.bx / fBlockWidth, by = line.by / fBlockWidth;
+		if (ay > by) { swap(ax, bx); swap(ay, by); }
+		if (min(ax, bx) < 0.0f || ay < 0.0f || max(ax, bx) >= nWorldWidth || by >= nWorldHeight)
+			return false;
+
+		float fSlope = by > ay ? (bx - ax) / (by - ay) : 0.0f;
+		int yStart = (int)ay;
+		int yEnd = max(yStart, (int)ceilf(by) - 1);
+		for (int y = yStart; y <= yEnd; y++)
+		{
+			// Where the segment enters and leaves the row
+			float xa = ax + (max(ay, (float)y) - ay) * fSlope;
+			float xb = by > ay ? ax + (min(by, y + 1.0f) - ay) * fSlope : bx;
+			if (xa > xb) swap(xa, xb);
+
+			int xStart = (int)xa;
+			int xEnd = max(xStart, (int)ceilf(xb) - 1);
+			if (AnyBlockInRow(y, xStart, xEnd))
+				return false;
+		}
+		return true;
+	}
+
+	// Whether any of cells xStart..xEnd of row y is a block
+	bool AnyBlockInRow(int y, int xStart, int xEnd) const {
+		const uint64_t *row = vecBlockRows.data() + y * nBlockRowWords;
+		int wStart = xStart >> 6, wEnd = xEnd >> 6;
+		for (int w = wStart; w <= wEnd; w++)
+		{
+			uint64_t mask = ~uint64_t(0);
+			if (w == wStart) mask &= ~uint64_t(0) << (xStart & 63);
+			if (w == wEnd) mask &= ~uint64_t(0) >> (63 - (xEnd & 63));
+			if (row[w] & mask)
+				return true;
+		}
+		return false;
+	}
+
+	// Bring the bit rows of the blocks up to date with the cells, after the
+	// PolyMap has changed
+	void UpdateBlockRows() {
+		if (bBlockRowsValid && nBlockRowsGeneration == nPolyMapGeneration)
+			return;
+
+		nBlockRowWords = (nWorldWidth + 63) / 64;
+		vecBlockRows.assign(nBlockRowWords * nWorldHeight, 0);
+		for (int y = 0; y < nWorldHeight; y++)
+			for (int x = 0; x < nWorldWidth; x++)
+				if (world[y * nWorldWidth + x].exist)
+					vecBlockRows[y * nBlockRowWords + (x >> 6)] |= uint64_t(1) << (x & 63);
+
+		nBlockRowsGeneration = nPolyMapGeneration;
+		bBlockRowsValid = true;
+	}
+
+	// Add the tiles the lights see now to those explored, the mouse light's
+	// too when it is on
+	void UpdateFogOfWar(bool bMouseLight, float fSourceX, float fSourceY) {
+		if (nFogGeneration != nPolyMapGeneration)
+		{
+			nFogGeneration = nPolyMapGeneration;
+			nFogLights = 0;
+		}
+
+		auto explore = [&](float x, float y, float radius)
+		{
+			CalculateTileVisibility((int)(x / fBlockWidth), (int)(y / fBlockWidth), (int)(radius / fBlockWidth), tilesExplored, true);
+		};
+		for (nFogLights = min(nFogLights, vecLights.size()); nFogLights < vecLights.size(); nFogLights++)
+			explore(vecLights[nFogLights].x, vecLights[nFogLights].y, vecLights[nFogLights].radius);
+		if (bMouseLight)
+			explore(fSourceX, fSourceY, fLightRadius);
+	}
+
+	void CalculateVisibilityPolygon(float originX, float originY, float radius) {
+		sLight light = { originX, originY, radius };
+		size_t nCornersBefore = nCornersTotal, nEdgeEndsBefore = nEdgeEndsTotal;
+		CalculateVisibilityPolygons(&light, 1, &vecVisibilityPolygonPoints, bVisibilityCache ? &mouseLightCache : nullptr);
+
+		// Cache hits gather nothing, so keep the last counts
+		if (nEdgeEndsTotal != nEdgeEndsBefore)
+		{
+			nMouseCorners = nCornersTotal - nCornersBefore;
+			nMouseEdgeEnds = nEdgeEndsTotal - nEdgeEndsBefore;
+		}
+	}
+
+	// Use nThreads threads (including the caller) for CalculateVisibilityPolygons
+	void SetVisibilityThreads(int nThreads) {
+		threadPool.SetThreadCount(nThreads);
+		vecThreadScratch.resize(threadPool.ThreadCount());
+		vecSplitPoints.resize(threadPool.ThreadCount());
+	}
+
+	// Calculate the visibility polygons of nLights lights in one go, into
+	// polygons[0..nLights). The buffers are cleared and refilled, so when the
+	// caller keeps them from frame to frame they don't need reallocating.
+	// Only reads the PolyMap, so the lights are shared out between threads.
+	// Each light only works on the edges within its radius. Given a cache
+	// for every light, the polygons of the lights still where they were are
+	// left as they are.
+	void CalculateVisibilityPolygons(const sLight *lights, int nLights, vector<tuple<float, float, float>> *polygons, sVisibilityCache *caches = nullptr) {
+		int nThreads = threadPool.ThreadCount();
+
+		// Fewer lights than threads on a big map, so split each light up
+		// instead, if it reaches enough of the map to be worth it
+		if (nThreads > 1 && nLights < nThreads && (int)vecEdges.size() >= nSplitLightEdges)
+		{
+			for (int l = 0; l < nLights; l++)
+			{
+				if (caches && LookupVisibilityCache(caches[l], lights[l]))
+					continue;
+
+				GatherLightEdges(lights[l], vecThreadScratch[0], splitEdges);
+				if ((int)splitEdges.vecEdges.size() >= nSplitLightEdges)
+					CalculateLightVisibilitySplit(lights[l], splitEdges, polygons[l]);
+				else
+					CalculateLightVisibility(lights[l], splitEdges, vecThreadScratch[0], polygons[l]);
+			}
+			return;
+		}
+
+		threadPool.ParallelFor(nLights, [&](int l, int nThread)
+		{
+			if (caches)
+				CalculateLightVisibilityCached(lights[l], caches[l], vecThreadScratch[nThread], polygons[l]);
+			else
+				CalculateLightVisibility(lights[l], vecThreadScratch[nThread], polygons[l]);
+		});
+	}
+
+	// Calculate one light with every thread working on a part of it: an angular
+	// sector each for the sweep, a share of the endpoints for the rays engines
+	void CalculateLightVisibilitySplit(const sLight &light, const sLightEdges &local, vector<tuple<float, float, float>> &vecPoints) {
+		int nParts = threadPool.ThreadCount();
+
+		threadPool.ParallelFor(nParts, [&](int part, int nThread)
+		{
+			vector<tuple<float, float, float>> &vecPart = vecSplitPoints[part];
+			if (nVisibilityEngine == VIS_ANGULAR_SWEEP)
+			{
+				float fFrom = -3.14159265f + 6.2831853f * part / nParts;
+				float fTo = part == nParts - 1 ? INFINITY : -3.14159265f + 6.2831853f * (part + 1) / nParts;
+				CalculateVisibilityPolygonSweep(local.vecEdges, light, vecThreadScratch[nThread], vecPart, fFrom, fTo);
+			}
+			else
+			{
+				size_t nEndpoints = local.vecEndpoints.size();
+				vecPart.clear();
+				CastRaysAtEndpoints(light, local, nEndpoints * part / nParts, nEndpoints * (part + 1) / nParts, vecPart);
+			}
+		});
+
+		// Stitch the parts back together. Sectors come out in order already
+		vecPoints.clear();
+		for (auto &vecPart : vecSplitPoints)
+			vecPoints.insert(vecPoints.end(), vecPart.begin(), vecPart.end());
+		if (nVisibilityEngine != VIS_ANGULAR_SWEEP)
+			SortPolygonPoints(vecPoints);
+	}
+
+	void CalculateLightVisibility(const sLight &light, sVisibilityScratch &scratch, vector<tuple<float, float, float>> &vecPoints) {
+		GatherLightEdges(light, scratch, scratch.local);
+		CalculateLightVisibility(light, scratch.local, scratch, vecPoints);
+	}
+
+	void CalculateLightVisibility(const sLight &light, const sLightEdges &local, sVisibilityScratch &scratch, vector<tuple<float, float, float>> &vecPoints) {
+		switch (nVisibilityEngine)
+		{
+		case VIS_ANGULAR_SWEEP: CalculateVisibilityPolygonSweep(local.vecEdges, light, scratch, vecPoints); break;
+		default: CalculateVisibilityPolygonRays(light, local, vecPoints); break;
+		}
+	}
+
+	// Whether a light's polygon is still what it was last worked out from.
+	// If not, the cache is brought up to date for the light, which has to be
+	// worked out again.
+	bool LookupVisibilityCache(sVisibilityCache &cache, const sLight &light) {
+		int nKeyX = (int)floorf(light.x / fVisibilityCacheStep);
+		int nKeyY = (int)floorf(light.y / fVisibilityCacheStep);
+		uint32_t nSettings = nVisibilityEngine | (bTrigFreeRays ? 0x10 : 0) | (bSimdRays ? 0x20 : 0);
+
+		bool bHit = cache.bValid && cache.nGeneration == nPolyMapGeneration && cache.nSettings == nSettings &&
+			cache.radius == light.radius && nKeyX == cache.nKeyX && nKeyY == cache.nKeyY;
+		if (!bHit)
+		{
+			cache.bValid = true;
+			cache.nKeyX = nKeyX; cache.nKeyY = nKeyY;
+			cache.radius = light.radius;
+			cache.nGeneration = nPolyMapGeneration;
+			cache.nSettings = nSettings;
+		}
+
+		(bHit ? nCacheHits : nCacheMisses).fetch_add(1, memory_order_relaxed);
+		return bHit;
+	}
+
+	// CalculateLightVisibility for a light with a cache: nothing to do if it hits
+	void CalculateLightVisibilityCached(const sLight &light, sVisibilityCache &cache, sVisibilityScratch &scratch, vector<tuple<float, float, float>> &vecPoints) {
+		if (!LookupVisibilityCache(cache, light))
+			CalculateLightVisibility(light, scratch, vecPoints);
+	}
+
+	// Gather the edges of the PolyMap within the light's radius into local,
+	// from the edge grid buckets under it, and clip them to the light's
+	// polygon. Then lay them out the way the engine in use wants them.
+	void GatherLightEdges(const sLight &light, sVisibilityScratch &scratch, sLightEdges &local) {
+		vector<sEdge> &vecLocal = local.vecEdges;
+		vecLocal.clear();
+
+		int x0 = max(0, (int)floorf((light.x - light.radius) / fEdgeGridCellSize));
+		int y0 = max(0, (int)floorf((light.y - light.radius) / fEdgeGridCellSize));
+		int x1 = min(nEdgeGridWidth - 1, (int)floorf((light.x + light.radius) / fEdgeGridCellSize));
+		int y1 = min(nEdgeGridHeight - 1, (int)floorf((light.y + light.radius) / fEdgeGridCellSize));
+
+		// A light reaching most of the map might as well take every edge
+		bool bInGrid = x0 <= x1 && y0 <= y1;
+		if (bInGrid && (size_t)(x1 - x0 + 1) * (y1 - y0 + 1) * 4 >= vecEdges.size())
+		{
+			for (auto &edge : vecEdges)
+				if (!IsEdgeEmpty(edge))
+					vecLocal.push_back(edge);
+		}
+		else if (bInGrid)
+		{
+			if (scratch.vecEdgeStamp.size() < vecEdges.size())
+				scratch.vecEdgeStamp.resize(vecEdges.size(), 0);
+			if (++scratch.nStamp == 0)
+			{
+				fill(scratch.vecEdgeStamp.begin(), scratch.vecEdgeStamp.end(), 0);
+				scratch.nStamp = 1;
+			}
+
+			for (int y = y0; y <= y1; y++)
+				for (int x = x0; x <= x1; x++)
+					for (int edge_id : vecEdgeGrid[y * nEdgeGridWidth + x])
+						if (scratch.vecEdgeStamp[edge_id] != scratch.nStamp)
+						{
+							scratch.vecEdgeStamp[edge_id] = scratch.nStamp;
+							vecLocal.push_back(vecEdges[edge_id]);
+						}
+		}
+
+		ClipLightEdges(light, vecLocal);
+
+		// Every corner is aimed at once, however many edges meet there
+		vector<pair<float, float>> &vecEndpoints = local.vecEndpoints;
+		vecEndpoints.clear();
+		if (nVisibilityEngine != VIS_ANGULAR_SWEEP)
+		{
+			for (auto &edge : vecLocal)
+			{
+				vecEndpoints.push_back({ edge.startX, edge.startY });
+				vecEndpoints.push_back({ edge.endX, edge.endY });
+			}
+			sort(vecEndpoints.begin(), vecEndpoints.end());
+			vecEndpoints.erase(unique(vecEndpoints.begin(), vecEndpoints.end()), vecEndpoints.end());
+			nCornersTotal.fetch_add(vecEndpoints.size(), memory_order_relaxed);
+			nEdgeEndsTotal.fetch_add(2 * vecLocal.size(), memory_order_relaxed);
+		}
+
+		if (nVisibilityEngine == VIS_BRUTE_FORCE && bSimdRays)
+			local.soa.Build(vecLocal);
+	}
+
+	// Outward normals of the sides of the regular polygon a light's circle is
+	// approximated by. Side k runs from corner k to corner k + 1, and corner k
+	// is at angle 2 pi k / LIGHT_SIDES on the circle.
+	static const pair<float, float> *LightSideNormals() {
+		static const vector<pair<float, float>> normals = []
+		{
+			vector<pair<float, float>> v;
+			for (int k = 0; k < LIGHT_SIDES; k++)
+				v.push_back({ cosf(3.14159265f * (2 * k + 1) / LIGHT_SIDES), sinf(3.14159265f * (2 * k + 1) / LIGHT_SIDES) });
+			return v;
+		}();
+		return normals.data();
+	}
+
+	// Distance of the sides from the light, for a radius of 1
+	static float LightSideDistance() {
+		static const float fDistance = cosf(3.14159265f / LIGHT_SIDES);
+		return fDistance;
+	}
+
+	// Cut the edges down to the parts inside the light's polygon (Cyrus-Beck),
+	// dropping those with nothing inside, and add the polygon's sides so the
+	// visibility polygon ends at the radius wherever nothing is in the way.
+	static void ClipLightEdges(const sLight &light, vector<sEdge> &edges) {
+		const pair<float, float> *normals = LightSideNormals();
+		float fSide = light.radius * LightSideDistance();
+
+		// Both ends within the circle inside the polygon keeps the whole edge
+		auto inside = [&](float x, float y) { return (x - light.x) * (x - light.x) + (y - light.y) * (y - light.y) < fSide * fSide; };
+
+		size_t n = 0;
+		for (const sEdge &edge : edges)
+		{
+			if (inside(edge.startX, edge.startY) && inside(edge.endX, edge.endY))
+			{
+				edges[n++] = edge;
+				continue;
+			}
+
+			float dx = edge.endX - edge.startX, dy = edge.endY - edge.startY;
+			float t0 = 0.0f, t1 = 1.0f;
+			for (int k = 0; k < LIGHT_SIDES && t0 < t1; k++)
+			{
+				// The edge is inside the side while dist + rate * t <= fSide
+				float dist = normals[k].first * (edge.startX - light.x) + normals[k].second * (edge.startY - light.y);
+				float rate = normals[k].first * dx + normals[k].second * dy;
+				if (rate > 0.0f) t1 = min(t1, (fSide - dist) / rate);
+				else if (rate < 0.0f) t0 = max(t0, (fSide - dist) / rate);
+				else if (dist > fSide) t1 = -1.0f;
+			}
+			if (t0 >= t1)
+				continue;
+
+			sEdge clipped = edge;
+			if (t0 > 0.0f) { clipped.startX = edge.startX + dx * t0; clipped.startY = edge.startY + dy * t0; }
+			if (t1 < 1.0f) { clipped.endX = edge.startX + dx * t1; clipped.endY = edge.startY + dy * t1; }
+			edges[n++] = clipped;
+		}
+		edges.resize(n);
+
+		for (int k = 0; k < LIGHT_SIDES; k++)
+		{
+			float a0 = 6.2831853f * k / LIGHT_SIDES, a1 = 6.2831853f * (k + 1) / LIGHT_SIDES;
+			sEdge side;
+			side.startX = light.x + light.radius * cosf(a0); side.startY = light.y + light.radius * sinf(a0);
+			side.endX = light.x + light.radius * cosf(a1); side.endY = light.y + light.radius * sinf(a1);
+			edges.push_back(side);
+		}
+	}
+
+	// Calculate the visibility polygons of lights in a ChunkedWorld. A light
+	// only looks at the chunks within its radius, so the size of the world
+	// makes no difference. Always uses the angular sweep, which needs no index
+	// over the edges, as every light has its own set of them.
+	void CalculateVisibilityPolygonsChunked(ChunkedWorld &chunks, const sLight *lights, int nLights, vector<tuple<float, float, float>> *polygons) {
+		for (int l = 0; l < nLights; l++)
+			chunks.PageIn(lights[l].x - lights[l].radius, lights[l].y - lights[l].radius, lights[l].x + lights[l].radius, lights[l].y + lights[l].radius);
+		chunks.RefreshEdges();
+
+		threadPool.ParallelFor(nLights, [&](int l, int nThread)
+		{
+			sVisibilityScratch &scratch = vecThreadScratch[nThread];
+			GatherLightEdges(chunks, lights[l], scratch);
+			CalculateVisibilityPolygonSweep(scratch.local.vecEdges, lights[l], scratch, polygons[l]);
+		});
+	}
+
+	// The edges of the chunks within the light's radius, clipped to its polygon
+	static void GatherLightEdges(const ChunkedWorld &chunks, const sLight &light, sVisibilityScratch &scratch) {
+		vector<sEdge> &vecLocal = scratch.local.vecEdges;
+		vecLocal.clear();
+		chunks.GatherEdges(light.x - light.radius, light.y - light.radius, light.x + light.radius, light.y + light.radius, vecLocal, scratch.gather);
+		ClipLightEdges(light, vecLocal);
+	}
+
+	// Remove duplicate (or simply similar) points from polygon
+	static void RemoveDuplicatePoints(vector<tuple<float, float, float>> &vecPoints) {
+		auto it = unique(
+			vecPoints.begin(),
+			vecPoints.end(),
+			[&](const tuple<float, float, float> &t1, const tuple<float, float, float> &t2)
+			{
+				return fabs(get<1>(t1) - get<1>(t2)) < 0.1f && fabs(get<2>(t1) - get<2>(t2)) < 0.1f;
+			});
+
+		vecPoints.resize(distance(vecPoints.begin(), it));
+	}
+
+	// Allocate an empty world of the given size, with a boundary around it
+	void CreateWorld(int width, int height) {
+		delete[] world;
+		nWorldWidth = width;
+		nWorldHeight = height;
+
+		//Allocating the memory for the world
+		world = new sCell[nWorldWidth * nWorldHeight];
+
+		// Add a boundary to the world
+		for (int x = 1; x < (nWorldWidth - 1); x++)
+		{
+			world[1 * nWorldWidth + x].exist = true;
+			world[(nWorldHeight - 2) * nWorldWidth + x].exist = true;
+
+			world[(nWorldHeight - 2) * nWorldWidth + x].boundary = true;
+			world[1 * nWorldWidth + x].boundary = true;
+		}
+
+		for (int x = 1; x < (nWorldHeight - 1); x++)
+		{
+			world[x * nWorldWidth + 1].exist = true;
+			world[x * nWorldWidth + (nWorldWidth - 2)].exist = true;
+
+			world[x * nWorldWidth + (nWorldWidth - 2)].boundary = true;
+			world[x * nWorldWidth + 1].boundary = true;
+		}
+	}
+
+	friend int RunBenchmark(int argc, char *argv[]);
+	friend int RunChunkedBenchmark(const string &sMapFile, int nLights, float fRadius, float fSeconds, mt19937 &rng);
+	friend int RunHeadless(int argc, char *argv[]);
+
+public:
+    bool OnUserCreate() override {
+
+		CreateWorld(nWorldWidth, nWorldHeight);
+
+		sprLightCast = new olc::Sprite("light_cast.png");
+
+		// Create some screen-sized off-screen buffers for lighting effect
+		sprLightmap = new olc::Sprite(ScreenWidth(), ScreenHeight());
+		lightMask.Resize(ScreenWidth(), ScreenHeight());
+		lightAccum.Resize(ScreenWidth(), ScreenHeight());
+		bakedAccum.Resize(ScreenWidth(), ScreenHeight());
+
+		// Build the initial PolyMap, later clicks may only patch it
+		ConvertTileMapToPolyMap(0, 0, nWorldWidth, nWorldHeight, fBlockWidth, nWorldWidth);
+
+		
+
+        return true;
+    }
+
+    bool OnUserUpdate(float fElapsedTime) override {
+
+		profiler.BeginFrame();
+		auto frameTimer = profiler.Time(PROF_FRAME);
+
+		// Defining a "debug" mode for the edges visualisation
+		bool debugMode = false;
+
+		// Get a snapshot of the mouse coordinate
+		float fSourceX = GetMouseX();
+		float fSourceY = GetMouseY();
+
+		// On mouse click (released)
+		if (GetMouse(0).bReleased) {
+			// Get the index representing which block was selected/clicked
+			// i = y * width + x
+			int i = ((int)fSourceY / (int)fBlockWidth) * nWorldWidth + ((int)fSourceX / (int)fBlockWidth);
+			
+			// Toggle the exist flag from cell
+			world[i].exist = !world[i].exist;
+			MarkLightsNearCell(i % nWorldWidth, i / nWorldWidth);
+
+			auto timer = profiler.Time(PROF_POLYMAP);
+			if (bIncrementalPolyMap)
+			{
+				// Only fix up the edges around the clicked block
+				UpdatePolyMapCell(i % nWorldWidth, i / nWorldWidth, 0, 0, nWorldWidth, nWorldHeight, fBlockWidth, nWorldWidth);
+			}
+			else
+			{
+				// Take a region of the Tile map and convert it to a "PolyMap" 
+				ConvertTileMapToPolyMap(0, 0, 40, 30, fBlockWidth, nWorldWidth);
+			}
+
+		}
+
+		if (GetKey(olc::Key::I).bPressed)
+			bIncrementalPolyMap = !bIncrementalPolyMap;
+
+		// Double the visibility threads, back to 1 after the core count
+		if (GetKey(olc::Key::T).bPressed)
+		{
+			int nThreads = threadPool.ThreadCount() * 2;
+			SetVisibilityThreads(nThreads > (int)max(1u, thread::hardware_concurrency()) ? 1 : nThreads);
+		}
+
+		// Cycle through the visibility algorithms to compare them
+		if (GetKey(olc::Key::M).bPressed)
+		{
+			nVisibilityEngine = (VisibilityEngine)((nVisibilityEngine + 1) % VIS_ENGINE_COUNT);
+			MarkAllLightsDirty();
+		}
+
+		if (GetKey(olc::Key::A).bPressed)
+		{
+			bTrigFreeRays = !bTrigFreeRays;
+			MarkAllLightsDirty();
+		}
+
+		if (GetKey(olc::Key::V).bPressed)
+		{
+			bSimdRays = !bSimdRays;
+			MarkAllLightsDirty();
+		}
+
+		if (GetKey(olc::Key::B).bPressed)
+		{
+			bBakeLights = !bBakeLights;
+			MarkAllLightsDirty();
+		}
+
+		// Cycle the light radius between the whole map and two shorter reaches
+		if (GetKey(olc::Key::R).bPressed)
+			fLightRadius = fLightRadius > 500.0f ? 300.0f : fLightRadius > 200.0f ? 150.0f : 1000.0f;
+
+		// Cycle the size of new lights: a point, then ever bigger discs
+		if (GetKey(olc::Key::S).bPressed)
+			fLightSize = fLightSize >= 16.0f ? 0.0f : fLightSize == 0.0f ? 4.0f : fLightSize * 2.0f;
+
+		if (GetKey(olc::Key::F).bPressed)
+			bShowTileVisibility = !bShowTileVisibility;
+
+		// The fog comes back over everything when turned on again
+		if (GetKey(olc::Key::G).bPressed)
+		{
+			bFogOfWar = !bFogOfWar;
+			tilesExplored.Resize(nWorldWidth, nWorldHeight);
+			nFogLights = 0;
+		}
+
+		// Dropping the cache makes every light start over
+		if (GetKey(olc::Key::K).bPressed)
+		{
+			bVisibilityCache = !bVisibilityCache;
+			mouseLightCache.bValid = false;
+			for (auto &cache : vecLightCaches)
+				cache.bValid = false;
+		}
+
+		if (GetKey(olc::Key::P).bPressed)
+			bShowProfiler = !bShowProfiler;
+		if (GetKey(olc::Key::O).bPressed)
+			DumpProfile("profile");
+
+		// Place a light at the mouse, or remove them all
+		if (GetKey(olc::Key::L).bPressed)
+		{
+			vecLights.push_back({ fSourceX, fSourceY, fLightRadius, LightColours[nNextLightColour], fLightSize });
+			nNextLightColour = (nNextLightColour + 1) % 5;
+			vecLightDirty.push_back(1);
+			bLightmapDirty = true;
+		}
+		if (GetKey(olc::Key::C).bPressed)
+		{
+			vecLights.clear();
+			vecLightCaches.clear();
+			vecLightDirty.clear();
+			bLightmapDirty = true;
+		}
+
+		{
+			auto timer = profiler.Time(PROF_VISIBILITY);
+
+			if (GetMouse(1).bHeld)
+			{
+				CalculateVisibilityPolygon(fSourceX, fSourceY, fLightRadius);
+			}
+
+			// Placed lights are all done in one batch, reusing last frame's buffers
+			vecLightPolygons.resize(vecLights.size());
+			vecLightCaches.resize(vecLights.size());
+			if (!bBakeLights)
+				CalculateVisibilityPolygons(vecLights.data(), vecLights.size(), vecLightPolygons.data(), bVisibilityCache ? vecLightCaches.data() : nullptr);
+		}
+		if (bBakeLights)
+		{
+			auto timer = profiler.Time(PROF_BAKE);
+			BakeLightmap();
+		}
+		else
+		{
+			auto timer = profiler.Time(PROF_DEDUP);
+			for (auto &polygon : vecLightPolygons)
+				RemoveDuplicatePoints(polygon);
+		}
+
+
+
+		// Drawing
+		SetDrawTarget(nullptr);
+		Clear(olc::BLACK);
+
+
+		int nRaysCast = vecVisibilityPolygonPoints.size();
+
+		{
+			auto timer = profiler.Time(PROF_DEDUP);
+			RemoveDuplicatePoints(vecVisibilityPolygonPoints);
+		}
+
+		int nRaysCast2 = vecVisibilityPolygonPoints.size();
+
+		bool bMouseLight = GetMouse(1).bHeld && vecVisibilityPolygonPoints.size() > 1;
+
+		// Lights still drawn every frame: the mouse light, and the placed
+		// lights when they aren't baked
+		const size_t nFrameLights = bBakeLights ? 0 : vecLights.size();
+
+		if (bMouseLight || nFrameLights > 0)
+		{
+			// Start from the baked lights, if any
+			{
+				auto timer = profiler.Time(PROF_COMPOSITE);
+				if (bBakeLights)
+					lightAccum.CopyFrom(bakedAccum);
+				else
+					lightAccum.Clear();
+			}
+
+			{
+				auto timer = profiler.Time(PROF_FANS);
+				if (bMouseLight)
+					AddLight(lightAccum, { fSourceX, fSourceY, fLightRadius, olc::WHITE, fLightSize }, vecVisibilityPolygonPoints);
+				for (size_t l = 0; l < nFrameLights; l++)
+					AddLight(lightAccum, vecLights[l], vecLightPolygons[l]);
+			}
+
+			auto timer = profiler.Time(PROF_COMPOSITE);
+			lightAccum.ToneMap(GetDrawTarget()->GetData());
+		}
+		else if (bBakeLights && !vecLights.empty())
+		{
+			// Only the baked lights, already tone mapped
+			auto timer = profiler.Time(PROF_COMPOSITE);
+			memcpy(GetDrawTarget()->GetData(), sprLightmap->GetData(), sizeof(olc::Pixel) * ScreenWidth() * ScreenHeight());
+		}
+
+		// Draw Blocks from TileMap
+		{
+			auto timer = profiler.Time(PROF_TILES);
+			if (bFogOfWar)
+			{
+				UpdateFogOfWar(bMouseLight, fSourceX, fSourceY);
+				SetPixelMode(olc::Pixel::ALPHA);
+			}
+
+			for (int x = 0; x < nWorldWidth; x++)
+				for (int y = 0; y < nWorldHeight; y++)
+				{
+					if (world[y * nWorldWidth + x].exist)
+						if (world[y * nWorldWidth + x].boundary) {
+							FillRect(x * fBlockWidth, y * fBlockWidth, fBlockWidth, fBlockWidth, olc::DARK_RED);
+						}
+						else {
+							FillRect(x *fBlockWidth, y *fBlockWidth, fBlockWidth, fBlockWidth, olc::BLUE);
+						}
+
+					// Dim the tiles not explored yet
+					if (bFogOfWar && !tilesExplored.Get(x, y))
+						FillRect(x * fBlockWidth, y * fBlockWidth, fBlockWidth, fBlockWidth, olc::Pixel(0, 0, 0, 192));
+				}
+
+			SetPixelMode(olc::Pixel::NORMAL);
+		}
+
+		// Mark the tiles seen from the mouse's tile, within the light radius
+		if (bShowTileVisibility)
+		{
+			CalculateTileVisibility((int)(fSourceX / fBlockWidth), (int)(fSourceY / fBlockWidth), (int)(fLightRadius / fBlockWidth), tileVisibility);
+			for (int y = 0; y < nWorldHeight; y++)
+				for (int x = 0; x < nWorldWidth; x++)
+					if (tileVisibility.Get(x, y))
+						FillRect(x * fBlockWidth + fBlockWidth / 2 - 1, y * fBlockWidth + fBlockWidth / 2 - 1, 3, 3, olc::GREEN);
+		}
 
-							// Update tile information with edge information
-							world[i].edge_id[EAST] = edge_id;
-							world[i].edge_exist[EAST] = true;
-						}
-					}
+		// Draw Edges from PolyMap
+		if (GetKey(olc::Key::D).bHeld) {
+			debugMode = true;
 
-					// If this cell doesnt have a northern neignbour, It needs a northern edge
-					if (!world[n].exist)
-					{
-						// It can either extend it from its western neighbour if they have
-						// one, or It can start a new one.
-						if (world[w].edge_exist[NORTH])
-						{
-							// Western neighbour has one, so grow it eastwards
-							vecEdges[world[w].edge_id[NORTH]].endX += fBlockWidth;
-							world[i].edge_id[NORTH] = world[w].edge_id[NORTH];
-							world[i].edge_exist[NORTH] = true;
-						}
-						else
-						{
-							// Western neighbour does not have one, so create one
-							sEdge edge;
-							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y) * fBlockWidth;
-							edge.endX = edge.startX + fBlockWidth; edge.endY = edge.startY;
+		}
 
-							// Add edge to Polygon Pool
-							int edge_id = vecEdges.size();
-							vecEdges.push_back(edge);
 
-							// Update tile information with edge information
-							world[i].edge_id[NORTH] = edge_id;
-							world[i].edge_exist[NORTH] = true;
-						}
-					}
+		if (debugMode) {
+			for (auto &edge : vecEdges)
+			{
+				if (IsEdgeEmpty(edge))
+					continue;
 
-					// If this cell doesnt have a southern neignbour, It needs a southern edge
-					if (!world[s].exist)
-					{
-						// It can either extend it from its western neighbour if they have
-						// one, or It can start a new one.
-						if (world[w].edge_exist[SOUTH])
-						{
-							// Western neighbour has one, so grow it eastwards
-							vecEdges[world[w].edge_id[SOUTH]].endX += fBlockWidth;
-							world[i].edge_id[SOUTH] = world[w].edge_id[SOUTH];
-							world[i].edge_exist[SOUTH] = true;
-						}
-						else
-						{
-							// Western neighbour does not have one, so I need to create one
-							sEdge edge;
-							edge.startX = (startX + x) * fBlockWidth; edge.startY = (startY + y + 1) * fBlockWidth;
-							edge.endX = edge.startX + fBlockWidth; edge.endY = edge.startY;
+				DrawLine(edge.startX, edge.startY, edge.endX, edge.endY);
+				FillCircle(edge.startX, edge.startY, 3, olc::BLUE);
+				FillCircle(edge.endX, edge.endY, 3, olc::BLUE);
+			}
+		}
 
-							// Add edge to Polygon Pool
-							int edge_id = vecEdges.size();
-							vecEdges.push_back(edge);
+		// The HUD goes over everything else
+		DrawString(4, 4, "Rays Cast: " + to_string(nRaysCast) + " Rays Drawn: " + to_string(nRaysCast2) + " Corners: " +
+			(nVisibilityEngine == VIS_ANGULAR_SWEEP ? string("-") : to_string(nMouseCorners) + "/" + to_string(nMouseEdgeEnds)));
+		DrawString(4, 14, string("Engine (M): ") + VisibilityEngineNames[nVisibilityEngine]);
+		DrawString(4, 24, string("PolyMap (I): ") + (bIncrementalPolyMap ? "Incremental" : "Full rebuild"));
+		DrawString(4, 34, "Lights (L/C): " + to_string(vecLights.size()));
+		DrawString(4, 44, "Threads (T): " + to_string(threadPool.ThreadCount()));
+		DrawString(4, 54, string("Ray angles (A): ") + (bTrigFreeRays ? "Trig free" : "atan2/cos/sin"));
+		DrawString(4, 64, string("Brute force rays (V): ") + (bSimdRays ? "SIMD" : "Scalar"));
+		DrawString(4, 74, "Light radius (R): " + to_string((int)fLightRadius));
+		DrawString(4, 84, string("Cache (K): ") + (bVisibilityCache ? "On" : "Off") + " hits " + to_string(nCacheHits) +
+			" misses " + to_string(nCacheMisses));
+		DrawString(4, 94, string("Lightmap (B): ") + (bBakeLights ? "Baked, last bake " + to_string(nLightsBaked) + " lights" : "Off"));
+		DrawString(4, 104, string("Soft shadows (S): ") + (fLightSize > 0.0f ? "Light size " + to_string((int)fLightSize) : "Off"));
+		DrawString(4, 114, string("Tiles seen (F): ") + (bShowTileVisibility ? to_string(tileVisibility.Count()) : "Off"));
+		DrawString(4, 124, string("Fog of war (G): ") + (bFogOfWar ? to_string(tilesExplored.Count()) + "/" + to_string(nWorldWidth * nWorldHeight) + " explored" : "Off"));
 
-							// Update tile information with edge information
-							world[i].edge_id[SOUTH] = edge_id;
-							world[i].edge_exist[SOUTH] = true;
-						}
-					}
+		if (bShowProfiler)
+			DrawProfiler(4, 140);
 
-				}
+		return true;
+    }
+
+	// Flag the placed lights reaching the cell, as it has changed
+	void MarkLightsNearCell(int x, int y) {
+		float fLeft = x * fBlockWidth, fTop = y * fBlockWidth;
+		float fRight = fLeft + fBlockWidth, fBottom = fTop + fBlockWidth;
 
+		for (size_t l = 0; l < vecLights.size(); l++)
+		{
+			const sLight &light = vecLights[l];
+			float dx = max(0.0f, max(fLeft - light.x, light.x - fRight));
+			float dy = max(0.0f, max(fTop - light.y, light.y - fBottom));
+			if (dx * dx + dy * dy <= light.radius * light.radius)
+			{
+				vecLightDirty[l] = 1;
+				bLightmapDirty = true;
 			}
+		}
 	}
 
-	void CalculateVisibilityPolygon(float originX, float originY, float radius) {
-		// Get rid of existing polygon
-		vecVisibilityPolygonPoints.clear();
+	void MarkAllLightsDirty() {
+		fill(vecLightDirty.begin(), vecLightDirty.end(), 1);
+		bLightmapDirty = true;
+	}
 
-		// For each edge in PolyMap
-		for (auto &edge1 : vecEdges)
-		{
-			// Take the start point, then the end point (we could use a pool of
-			// non-duplicated points here, it would be more optimal)
-			for (int i = 0; i < 2; i++)
+	// Add a light into an accumulator: fill its fan, softened for its size,
+	// into the light mask on its own, then add the "Radial Light" sprite
+	// (512x512) centred on it
+	void AddLight(sLightAccumulator &accum, const sLight &light, const vector<tuple<float, float, float>> &vecPolygon) {
+		lightMask.Clear();
+		lightMask.FillFan(light.x, light.y, vecPolygon);
+		lightMask.FillPenumbrae(light.x, light.y, light.size, vecPolygon, [&](float x, float y, float rdx, float rdy) { return WallDistance(x, y, rdx, rdy); });
+		accum.AddLight(lightMask, sprLightCast, (int)(light.x - 255), (int)(light.y - 255), light.colour);
+	}
+
+	// Work out the polygons of the flagged placed lights again, as one batch,
+	// then draw every placed light into the lightmap. Nothing to do while
+	// nothing has changed.
+	void BakeLightmap() {
+		if (!bLightmapDirty)
+			return;
+
+		vecBakeLights.clear();
+		vecBakeIds.clear();
+		for (size_t l = 0; l < vecLights.size(); l++)
+			if (vecLightDirty[l])
 			{
-				float rdx, rdy;
-				rdx = (i == 0 ? edge1.startX : edge1.endX) - originX;
-				rdy = (i == 0 ? edge1.startY : edge1.endY) - originY;
+				vecBakeLights.push_back(vecLights[l]);
+				vecBakeIds.push_back(l);
+				vecLightDirty[l] = 0;
+			}
 
-				float base_ang = atan2f(rdy, rdx);
+		// The polygon buffers are swapped in and out, so they keep their memory
+		nLightsBaked = vecBakeIds.size();
+		vecBakePolygons.resize(nLightsBaked);
+		for (int b = 0; b < nLightsBaked; b++)
+			swap(vecBakePolygons[b], vecLightPolygons[vecBakeIds[b]]);
+		CalculateVisibilityPolygons(vecBakeLights.data(), nLightsBaked, vecBakePolygons.data());
+		for (int b = 0; b < nLightsBaked; b++)
+		{
+			RemoveDuplicatePoints(vecBakePolygons[b]);
+			swap(vecBakePolygons[b], vecLightPolygons[vecBakeIds[b]]);
+		}
 
-				float ang = 0;
-				// For each point, cast 3 rays, 1 directly at point
-				// and 1 a little bit either side
-				for (int j = 0; j < 3; j++)
-				{
-					if (j == 0)	ang = base_ang - 0.0001f;
-					if (j == 1)	ang = base_ang;
-					if (j == 2)	ang = base_ang + 0.0001f;
+		// Same as drawing the lights in a frame, into the lightmap instead.
+		// The sum is kept too, for the mouse light to be added to.
+		bakedAccum.Clear();
+		for (size_t l = 0; l < vecLights.size(); l++)
+			AddLight(bakedAccum, vecLights[l], vecLightPolygons[l]);
 
-					// Create ray along angle for required distance
-					rdx = radius * cosf(ang);
-					rdy = radius * sinf(ang);
+		SetDrawTarget(sprLightmap);
+		Clear(olc::BLACK);
+		SetDrawTarget(nullptr);
+		bakedAccum.ToneMap(sprLightmap->GetData());
 
-					float min_t1 = INFINITY;
-					float min_px = 0, min_py = 0, min_ang = 0;
-					bool bValid = false;
+		bLightmapDirty = false;
+	}
 
-					// Check for ray intersection with all edges
-					for (auto &edge2 : vecEdges)
-					{
-						// Create line segment vector
-						float sdx = edge2.endX - edge2.startX;
-						float sdy = edge2.endY - edge2.startY;
+	// Timings of every stage over the frames kept, in microseconds
+	void DrawProfiler(int x, int y) {
+		FillRect(x - 2, y - 2, 8 * 36 + 4, 10 * (PROF_STAGE_COUNT + 1) + 2, olc::VERY_DARK_GREY);
+		DrawString(x, y, "Stage (us)        min    avg    p99", olc::YELLOW);
+		for (int s = 0; s < PROF_STAGE_COUNT; s++)
+		{
+			FrameProfiler::sStats stats = profiler.Stats((ProfileStage)s);
+			char line[64];
+			snprintf(line, sizeof(line), "%-12s %7.0f%7.0f%7.0f", ProfileStageNames[s], stats.min, stats.avg, stats.p99);
+			DrawString(x, y + 10 * (s + 1), line);
+		}
+	}
 
-						if (fabs(sdx - rdx) > 0.0f && fabs(sdy - rdy) > 0.0f)
-						{
-							// t2 is normalised distance from line segment start to line segment end of intersect point
-							float t2 = (rdx * (edge2.startY - originY) + (rdy * (originX - edge2.startX))) / (sdx * rdy - sdy * rdx);
-							// t1 is normalised distance from source along ray to ray length of intersect point
-							float t1 = (edge2.startX + sdx * t2 - originX) / rdx;
-
-							// If intersect point exists along ray, and along line 
-							// segment then intersect point is valid
-							if (t1 > 0 && t2 >= 0 && t2 <= 1.0f)
-							{
-								// Check if this intersect point is closest to source. If
-								// it is, then store this point and reject others
-								if (t1 < min_t1)
-								{
-									min_t1 = t1;
-									min_px = originX + rdx * t1;
-									min_py = originY + rdy * t1;
-									min_ang = atan2f(min_py - originY, min_px - originX);
-									bValid = true;
-								}
-							}
-						}
-					}
+	// Write the profiler's frames to <prefix>.csv and <prefix>.json
+	bool DumpProfile(const string &sPrefix) {
+		return profiler.DumpCsv(sPrefix + ".csv") && profiler.DumpChromeTrace(sPrefix + ".json");
+	}
+};
 
-					if (bValid)// Add intersection point to visibility polygon perimeter
-						vecVisibilityPolygonPoints.push_back({ min_ang, min_px, min_py });
-				}
+/*
+Benchmark of a binary tile-map, which is only ever read in around the
+lights. Times opening it, the first visibility pass (which reads in the
+chunks around the lights) and the passes after it.
+*/
+int RunChunkedBenchmark(const string &sMapFile, int nLights, float fRadius, float fSeconds, mt19937 &rng) {
+	ShadowCasting sc;
+	ChunkedWorld chunked(sc.fBlockWidth);
+
+	auto tStart = chrono::steady_clock::now();
+	if (!chunked.Open(sMapFile))
+	{
+		cerr << "Can't open " << sMapFile << " as a tile-map\n";
+		return 1;
+	}
+	double fOpen = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+
+	// Lights go in empty cells of stored chunks, looked up without reading the chunks in
+	vector<sLight> vecLights;
+	for (int l = 0; l < nLights && chunked.StoredChunkCount() > 0; l++)
+	{
+		const sTileMapChunk &entry = chunked.StoredChunk(rng() % chunked.StoredChunkCount());
+		for (int attempt = 0; attempt < 64; attempt++)
+		{
+			int x = entry.cx * CHUNK_SIZE + rng() % CHUNK_SIZE, y = entry.cy * CHUNK_SIZE + rng() % CHUNK_SIZE;
+			if (!chunked.GetCell(x, y))
+			{
+				vecLights.push_back({ (x + 0.5f) * sc.fBlockWidth, (y + 0.5f) * sc.fBlockWidth, fRadius });
+				break;
 			}
 		}
+	}
+	nLights = vecLights.size();
+	vector<vector<tuple<float, float, float>>> vecPolygons(nLights);
 
-		// Sort perimeter points by angle from source. This will allow
-		// us to draw a triangle fan.
-		sort(
-			vecVisibilityPolygonPoints.begin(),
-			vecVisibilityPolygonPoints.end(),
-			[&](const tuple<float, float, float> &t1, const tuple<float, float, float> &t2)
-			{
-				return get<0>(t1) < get<0>(t2);
-			});
+	tStart = chrono::steady_clock::now();
+	sc.CalculateVisibilityPolygonsChunked(chunked, vecLights.data(), nLights, vecPolygons.data());
+	double fFirst = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
 
+	cout << "Map " << sMapFile << ", " << chunked.StoredChunkCount() << " chunks stored, " << nLights << " lights\n\n";
+	printf("%-28s %14s\n", "stage", "ns/op");
+	printf("%-28s %14.0f\n", "Open", fOpen * 1e9);
+	printf("%-28s %14.0f   (%zu chunks read in)\n", "First visibility pass", nLights ? fFirst * 1e9 / nLights : 0.0, chunked.ChunkCount());
+
+	double fTotal = 0.0;
+	long nRuns = 0;
+	while (nLights > 0 && (fTotal < fSeconds || nRuns == 0))
+	{
+		tStart = chrono::steady_clock::now();
+		sc.CalculateVisibilityPolygonsChunked(chunked, vecLights.data(), nLights, vecPolygons.data());
+		fTotal += chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+		nRuns++;
 	}
+	printf("%-28s %14.0f\n", "Visibility chunked sweep", nRuns ? fTotal * 1e9 / ((double)nRuns * nLights) : 0.0);
+	return 0;
+}
 
+/*
+Headless benchmark (ShadowCasting --bench [options]). Times each stage of
+the pipeline on a generated or loaded map with fixed lights, without
+opening a window, and prints one line per stage:
+	ns/op      time for one op (one light for the visibility stages)
+	rays/s     rays cast per second, for the stages casting rays
+	allocs/op  heap allocations per op
+*/
+int RunBenchmark(int argc, char *argv[]) {
+	bCountAllocations = true;
 
+	int nWidth = 40, nHeight = 30, nLights = 16;
+	float fDensity = 0.15f, fSeconds = 0.5f, fRadius = 1000.0f;
+	unsigned nSeed = 1;
+	string sMapFile, sSaveFile;
+	bool bSaveEdges = true;
 
-public:
-    bool OnUserCreate() override {
+	for (int a = 2; a < argc; a++)
+	{
+		string arg = argv[a];
+		bool bValue = a + 1 < argc;
+		if (arg == "--width" && bValue) nWidth = max(4, atoi(argv[++a]));
+		else if (arg == "--height" && bValue) nHeight = max(4, atoi(argv[++a]));
+		else if (arg == "--density" && bValue) fDensity = (float)atof(argv[++a]);
+		else if (arg == "--seed" && bValue) nSeed = (unsigned)atoi(argv[++a]);
+		else if (arg == "--map" && bValue) sMapFile = argv[++a];
+		else if (arg == "--lights" && bValue) nLights = max(1, atoi(argv[++a]));
+		else if (arg == "--radius" && bValue) fRadius = (float)atof(argv[++a]);
+		else if (arg == "--time" && bValue) fSeconds = (float)atof(argv[++a]);
+		else if (arg == "--save" && bValue) sSaveFile = argv[++a];
+		else if (arg == "--no-edges") bSaveEdges = false;
+		else
+		{
+			cerr << "usage: " << argv[0] << " --bench [--width N] [--height N] [--density F] [--seed N]\n"
+				<< "       [--map file] [--lights N] [--radius pixels] [--time seconds]\n"
+				<< "       [--save file.sctm [--no-edges]]\n"
+				<< "A map file has one line per row of cells, '#' for a block and anything else for none,\n"
+				<< "or is a binary tile-map written by --save. --save writes the map out and stops.\n";
+			return 1;
+		}
+	}
 
-		//Allocating the memory for the world
-		world = new sCell[nWorldWidth * nWorldHeight];
+	mt19937 rng(nSeed);
 
-		// Add a boundary to the world
-		for (int x = 1; x < (nWorldWidth - 1); x++)
-		{
-			world[1 * nWorldWidth + x].exist = true;
-			world[(nWorldHeight - 2) * nWorldWidth + x].exist = true;
+	// Binary maps may be far too big to load whole, so they only go through the chunked stages
+	if (!sMapFile.empty() && sSaveFile.empty())
+	{
+		ifstream file(sMapFile, ios::binary);
+		char magic[4] = {};
+		if (file.read(magic, 4) && memcmp(magic, "SCTM", 4) == 0)
+			return RunChunkedBenchmark(sMapFile, nLights, fRadius, fSeconds, rng);
+	}
 
-			world[(nWorldHeight - 2) * nWorldWidth + x].boundary = true;
-			world[1 * nWorldWidth + x].boundary = true;
+	vector<string> rows;
+	if (!sMapFile.empty())
+	{
+		ifstream file(sMapFile);
+		if (!file)
+		{
+			cerr << "Can't open " << sMapFile << "\n";
+			return 1;
 		}
 
-		for (int x = 1; x < (nWorldHeight - 1); x++)
+		for (string row; getline(file, row); )
 		{
-			world[x * nWorldWidth + 1].exist = true;
-			world[x * nWorldWidth + (nWorldWidth - 2)].exist = true;
-
-			world[x * nWorldWidth + (nWorldWidth - 2)].boundary = true;
-			world[x * nWorldWidth + 1].boundary = true;
+			if (!row.empty() && row.back() == '\r')
+				row.pop_back();
+			rows.push_back(row);
 		}
+	}
 
-		sprLightCast = new olc::Sprite("light_cast.png");
+	// Convert the map straight into chunks, without the flat world, so huge ones fit
+	if (!sSaveFile.empty())
+	{
+		ChunkedWorld chunked(16.0f);
+		if (!sMapFile.empty())
+		{
+			for (int y = 0; y < (int)rows.size(); y++)
+				for (int x = 0; x < (int)rows[y].size(); x++)
+					if (rows[y][x] == '#')
+						chunked.SetCell(x, y, true);
+		}
+		else
+		{
+			// Same blocks as the generated flat map, boundary included
+			uniform_real_distribution<float> chance(0.0f, 1.0f);
+			for (int x = 1; x < nWidth - 1; x++)
+			{
+				chunked.SetCell(x, 1, true, true);
+				chunked.SetCell(x, nHeight - 2, true, true);
+			}
+			for (int y = 1; y < nHeight - 1; y++)
+			{
+				chunked.SetCell(1, y, true, true);
+				chunked.SetCell(nWidth - 2, y, true, true);
+			}
+			for (int y = 2; y < nHeight - 2; y++)
+				for (int x = 2; x < nWidth - 2; x++)
+					if (chance(rng) < fDensity)
+						chunked.SetCell(x, y, true);
+		}
 
-		// Create some screen-sized off-screen buffers for lighting effect
-		buffLightTex = new olc::Sprite(ScreenWidth(), ScreenHeight());
-		buffLightRay = new olc::Sprite(ScreenWidth(), ScreenHeight());
+		if (!chunked.Save(sSaveFile, bSaveEdges))
+		{
+			cerr << "Can't write " << sSaveFile << "\n";
+			return 1;
+		}
+		cout << "Wrote " << chunked.ChunkCount() << " chunks to " << sSaveFile << (bSaveEdges ? ", with edges\n" : "\n");
+		return 0;
+	}
 
+	ShadowCasting sc;
 
-		
+	if (!sMapFile.empty())
+	{
 
-        return true;
-    }
+		nWidth = 4;
+		for (auto &row : rows)
+			nWidth = max(nWidth, (int)row.size());
+		nHeight = max(4, (int)rows.size());
 
-    bool OnUserUpdate(float fElapsedTime) override {
+		// Take the cells as they are in the file, boundary included
+		sc.CreateWorld(nWidth, nHeight);
+		for (int y = 0; y < nHeight; y++)
+			for (int x = 0; x < nWidth; x++)
+				sc.world[y * nWidth + x].exist = y < (int)rows.size() && x < (int)rows[y].size() && rows[y][x] == '#';
+	}
+	else
+	{
+		sc.CreateWorld(nWidth, nHeight);
+		uniform_real_distribution<float> chance(0.0f, 1.0f);
+		for (int y = 2; y < nHeight - 2; y++)
+			for (int x = 2; x < nWidth - 2; x++)
+				sc.world[y * nWidth + x].exist = chance(rng) < fDensity;
+	}
 
-		// Defining a "debug" mode for the edges visualisation
-		bool debugMode = false;
+	int nScreenWidth = (int)(nWidth * sc.fBlockWidth);
+	int nScreenHeight = (int)(nHeight * sc.fBlockWidth);
+	auto build = [&] { sc.ConvertTileMapToPolyMap(0, 0, nWidth, nHeight, sc.fBlockWidth, nWidth); };
+	build();
 
-		// Defining the size of the block within cell
-		float fBlockWidth = 16.0f;
+	// Lights sit in the middle of empty cells, the same ones on every run with the same seed
+	vector<pair<int, int>> vecEmpty;
+	for (int y = 1; y < nHeight - 1; y++)
+		for (int x = 1; x < nWidth - 1; x++)
+			if (!sc.world[y * nWidth + x].exist)
+				vecEmpty.push_back({ x, y });
+	if (vecEmpty.empty())
+		vecEmpty.push_back({ nWidth / 2, nHeight / 2 });
 
-		// Get a snapshot of the mouse coordinate
-		float fSourceX = GetMouseX();
-		float fSourceY = GetMouseY();
+	vector<sLight> vecLights;
+	for (int l = 0; l < nLights; l++)
+	{
+		auto &cell = vecEmpty[rng() % vecEmpty.size()];
+		vecLights.push_back({ (cell.first + 0.5f) * sc.fBlockWidth, (cell.second + 0.5f) * sc.fBlockWidth, fRadius });
+	}
+	vector<vector<tuple<float, float, float>>> vecPolygons(nLights);
 
-		// On mouse click (released)
-		if (GetMouse(0).bReleased) {
-			// Get the index representing which block was selected/clicked
-			// i = y * width + x
-			int i = ((int)fSourceY / (int)fBlockWidth) * nWorldWidth + ((int)fSourceX / (int)fBlockWidth);
-			
-			// Toggle the exist flag from cell
-			world[i].exist = !world[i].exist;
+	// The same map again, in chunks
+	ChunkedWorld chunked(sc.fBlockWidth);
+	for (int y = 0; y < nHeight; y++)
+		for (int x = 0; x < nWidth; x++)
+			if (sc.world[y * nWidth + x].exist)
+				chunked.SetCell(x, y, true);
+	chunked.RefreshEdges();
 
-			// Take a region of the Tile map and convert it to a "PolyMap" 
-			ConvertTileMapToPolyMap(0, 0, 40, 30, fBlockWidth, nWorldWidth);
+	cout << "Map " << nWidth << "x" << nHeight << (sMapFile.empty() ? " generated" : " from " + sMapFile)
+		<< ", " << sc.vecEdges.size() - sc.vecFreeEdgeIds.size() << " edges, "
+		<< chunked.ChunkCount() << " chunks, " << nLights << " lights\n\n";
+	printf("%-28s %14s %14s %12s\n", "stage", "ns/op", "rays/s", "allocs/op");
 
-		}
+	// Run setup then the timed op until fSeconds have gone by, nOps ops at a
+	// time, and print the line for it. fRays is the rays cast by one op.
+	auto measure = [&](const string &sName, int nOps, double fRays, const function<void()> &setup, const function<void()> &op)
+	{
+		setup();
+		op();	// Warm up, so buffers have grown before counting allocations
 
-		if (GetMouse(1).bHeld)
+		double fTotal = 0.0;
+		size_t nAllocations = 0;
+		long nRuns = 0;
+		while (fTotal < fSeconds || nRuns == 0)
 		{
-			CalculateVisibilityPolygon(fSourceX, fSourceY, 1000.0f);
+			setup();
+			size_t nAllocationsBefore = nHeapAllocations.load(memory_order_relaxed);
+			auto tStart = chrono::steady_clock::now();
+			op();
+			fTotal += chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+			nAllocations += nHeapAllocations.load(memory_order_relaxed) - nAllocationsBefore;
+			nRuns++;
 		}
 
+		double fOps = (double)nRuns * nOps;
+		string sRays = fRays > 0.0 ? to_string((long long)(fRays * nRuns / fTotal)) : "-";
+		printf("%-28s %14.0f %14s %12.2f\n", sName.c_str(), fTotal * 1e9 / fOps, sRays.c_str(), nAllocations / fOps);
+	};
 
+	auto none = [] {};
 
-		// Drawing
-		SetDrawTarget(nullptr);
-		Clear(olc::BLACK);
+	measure("PolyMap full rebuild", 1, 0.0, none, build);
 
+	// Each cell is toggled twice in a row, so the map is back as it was after every pair
+	vector<pair<int, int>> vecToggles;
+	for (int t = 0; t < 64; t++)
+		vecToggles.push_back({ 2 + (int)(rng() % max(1, nWidth - 4)), 2 + (int)(rng() % max(1, nHeight - 4)) });
+	size_t nToggle = 0;
+	measure("PolyMap toggle cell", 1, 0.0, none, [&]
+	{
+		auto &cell = vecToggles[(nToggle++ / 2) % vecToggles.size()];
+		sc.world[cell.second * nWidth + cell.first].exist = !sc.world[cell.second * nWidth + cell.first].exist;
+		sc.UpdatePolyMapCell(cell.first, cell.second, 0, 0, nWidth, nHeight, sc.fBlockWidth, nWidth);
+	});
+	if (nToggle % 2 == 1)
+	{
+		auto &cell = vecToggles[(nToggle / 2) % vecToggles.size()];
+		sc.world[cell.second * nWidth + cell.first].exist = !sc.world[cell.second * nWidth + cell.first].exist;
+	}
+	build();
 
-		int nRaysCast = vecVisibilityPolygonPoints.size();
+	for (int e = 0; e < VIS_ENGINE_COUNT; e++)
+		for (int simd = 1; simd >= (e == VIS_BRUTE_FORCE ? 0 : 1); simd--)
+		{
+			sc.nVisibilityEngine = (VisibilityEngine)e;
+			sc.bSimdRays = simd == 1;
+			size_t nRaysBefore = sc.nRaysTotal;
+			sc.CalculateVisibilityPolygons(vecLights.data(), nLights, vecPolygons.data());
+			double fRays = (double)(sc.nRaysTotal - nRaysBefore);
+			string sName = string("Visibility ") + VisibilityEngineNames[e] + (e == VIS_BRUTE_FORCE ? (simd ? " SIMD" : " scalar") : "");
+			measure(sName, nLights, fRays, none, [&] { sc.CalculateVisibilityPolygons(vecLights.data(), nLights, vecPolygons.data()); });
+		}
 
-		// Remove duplicate (or simply similar) points from polygon
-		auto it = unique(
-			vecVisibilityPolygonPoints.begin(),
-			vecVisibilityPolygonPoints.end(),
-			[&](const tuple<float, float, float> &t1, const tuple<float, float, float> &t2)
-			{
-				return fabs(get<1>(t1) - get<1>(t2)) < 0.1f && fabs(get<2>(t1) - get<2>(t2)) < 0.1f;
-			});
+	nToggle = 0;
+	measure("Chunked toggle cell", 1, 0.0, none, [&]
+	{
+		auto &cell = vecToggles[(nToggle++ / 2) % vecToggles.size()];
+		chunked.SetCell(cell.first, cell.second, !chunked.GetCell(cell.first, cell.second));
+		chunked.RefreshEdges();
+	});
+	if (nToggle % 2 == 1)
+	{
+		auto &cell = vecToggles[(nToggle / 2) % vecToggles.size()];
+		chunked.SetCell(cell.first, cell.second, !chunked.GetCell(cell.first, cell.second));
+	}
+	measure("Visibility chunked sweep", nLights, 0.0, none, [&] { sc.CalculateVisibilityPolygonsChunked(chunked, vecLights.data(), nLights, vecPolygons.data()); });
 
-		vecVisibilityPolygonPoints.resize(distance(vecVisibilityPolygonPoints.begin(), it));
+	// Lights standing still are all cache hits, lights nudged back and forth
+	// a pixel every op all misses, costing what a light without a cache does
+	sc.nVisibilityEngine = VIS_ANGULAR_SWEEP;
+	vector<sVisibilityCache> vecCaches(nLights);
+	measure("Visibility cached still", nLights, 0.0, none, [&] { sc.CalculateVisibilityPolygons(vecLights.data(), nLights, vecPolygons.data(), vecCaches.data()); });
+	int nNudge = 0;
+	measure("Visibility cached moving", nLights, 0.0, none, [&]
+	{
+		float fNudge = nNudge++ % 2 ? -1.0f : 1.0f;
+		for (auto &light : vecLights)
+			light.x += fNudge;
+		sc.CalculateVisibilityPolygons(vecLights.data(), nLights, vecPolygons.data(), vecCaches.data());
+	});
+	if (nNudge % 2 == 1)
+		for (auto &light : vecLights)
+			light.x -= 1.0f;
 
-		int nRaysCast2 = vecVisibilityPolygonPoints.size();
-		DrawString(4, 4, "Rays Cast: " + to_string(nRaysCast) + " Rays Drawn: " + to_string(nRaysCast2));
+	// The rest works from the sweep's polygons
+	sc.CalculateVisibilityPolygons(vecLights.data(), nLights, vecPolygons.data());
+	vector<vector<tuple<float, float, float>>> vecDeduped = vecPolygons;
+
+	measure("Remove duplicate points", nLights, 0.0,
+		[&] { for (int l = 0; l < nLights; l++) vecDeduped[l].assign(vecPolygons[l].begin(), vecPolygons[l].end()); },
+		[&] { for (auto &polygon : vecDeduped) ShadowCasting::RemoveDuplicatePoints(polygon); });
 
+	sc.lightMask.Resize(nScreenWidth, nScreenHeight);
+	measure("Light mask fans", nLights, 0.0, none, [&]
+	{
+		sc.lightMask.Clear();
+		for (int l = 0; l < nLights; l++)
+			sc.lightMask.FillFan(vecLights[l].x, vecLights[l].y, vecDeduped[l]);
+	});
+
+	measure("Light mask soft, size 8", nLights, 0.0, none, [&]
+	{
+		sc.lightMask.Clear();
+		for (int l = 0; l < nLights; l++)
+		{
+			sc.lightMask.FillFan(vecLights[l].x, vecLights[l].y, vecDeduped[l]);
+			sc.lightMask.FillPenumbrae(vecLights[l].x, vecLights[l].y, 8.0f, vecDeduped[l], [&](float x, float y, float rdx, float rdy) { return sc.WallDistance(x, y, rdx, rdy); });
+		}
+	});
 
-		// If drawing rays, set an offscreen texture as our target buffer
-		if (GetMouse(1).bHeld && vecVisibilityPolygonPoints.size() > 1)
+	// Softening by averaging hard masks instead: only the visibility and
+	// fans of 8 points spread over each disc, not even the averaging
+	vector<sLight> vecJittered;
+	for (auto &light : vecLights)
+		for (int s = 0; s < 8; s++)
+			vecJittered.push_back({ light.x + 8.0f * cosf(s * 0.785f), light.y + 8.0f * sinf(s * 0.785f), light.radius });
+	vector<vector<tuple<float, float, float>>> vecJitteredPolygons(vecJittered.size());
+	measure("Light mask jittered x8", nLights, 0.0, none, [&]
+	{
+		sc.CalculateVisibilityPolygons(vecJittered.data(), vecJittered.size(), vecJitteredPolygons.data());
+		sc.lightMask.Clear();
+		for (size_t s = 0; s < vecJittered.size(); s++)
 		{
-			// Clear offscreen buffer for sprite
-			SetDrawTarget(buffLightTex);
-			Clear(olc::BLACK);
+			ShadowCasting::RemoveDuplicatePoints(vecJitteredPolygons[s]);
+			sc.lightMask.FillFan(vecJittered[s].x, vecJittered[s].y, vecJitteredPolygons[s]);
+		}
+	});
 
-			// Draw "Radial Light" sprite to offscreen buffer, centered around 
-			// source location (the mouse coordinates, buffer is 512x512)
-			DrawSprite(fSourceX - 255, fSourceY - 255, sprLightCast);
+	// Coloured lights added up under their own masks, with a made up falloff
+	// so no image file is needed
+	olc::Sprite sprFalloff(512, 512);
+	for (int y = 0; y < 512; y++)
+		for (int x = 0; x < 512; x++)
+		{
+			float fFade = max(0.0f, 1.0f - sqrtf((float)((x - 255) * (x - 255) + (y - 255) * (y - 255))) / 256.0f);
+			uint8_t v = (uint8_t)(255 * fFade);
+			sprFalloff.GetData()[y * 512 + x] = olc::Pixel(v, v, v);
+		}
+	vector<sLightMask> vecMasks(nLights);
+	for (int l = 0; l < nLights; l++)
+	{
+		vecMasks[l].Resize(nScreenWidth, nScreenHeight);
+		vecMasks[l].FillFan(vecLights[l].x, vecLights[l].y, vecDeduped[l]);
+		vecLights[l].colour = olc::Pixel(rng() & 0xFF, rng() & 0xFF, rng() & 0xFF);
+	}
+	sLightAccumulator accum;
+	accum.Resize(nScreenWidth, nScreenHeight);
 
-			// Clear offsecreen buffer for rays
-			SetDrawTarget(buffLightRay);
-			Clear(olc::BLANK);
+	// Entities asking whether each light reaches them, at pixel centres so
+	// the light masks can be checked against
+	const int nEntities = 4096;
+	vector<pair<float, float>> vecEntities(nEntities);
+	for (auto &entity : vecEntities)
+		entity = { (rng() % nScreenWidth) + 0.5f, (rng() % nScreenHeight) + 0.5f };
+	vector<sVisibilityLookup> vecLookups(nLights);
+	measure("Lit lookup build", nLights, 0.0, none, [&]
+	{
+		for (int l = 0; l < nLights; l++)
+			vecLookups[l].Build(vecLights[l].x, vecLights[l].y, vecDeduped[l]);
+	});
+	size_t nLit = 0;
+	measure("Lit lookup 4096 entities", nLights, 0.0, none, [&]
+	{
+		for (int l = 0; l < nLights; l++)
+			for (auto &entity : vecEntities)
+				nLit += vecLookups[l].IsLit(entity.first, entity.second);
+	});
+	long nDisagree = 0;
+	for (int l = 0; l < nLights; l++)
+		for (auto &entity : vecEntities)
+			nDisagree += vecLookups[l].IsLit(entity.first, entity.second) !=
+				(vecMasks[l].coverage[(int)entity.second * nScreenWidth + (int)entity.first] != 0);
+	printf("%-28s %13.2f%%\n", "Lit lookup vs light mask", 100.0 * nDisagree / ((double)nLights * nEntities));
+	for (int simd = 1; simd >= 0; simd--)
+		measure(string("Accumulate lights ") + (simd ? "SIMD" : "scalar"), nLights, 0.0, [&] { accum.Clear(); }, [&]
+		{
+			for (int l = 0; l < nLights; l++)
+				accum.AddLight(vecMasks[l], &sprFalloff, (int)(vecLights[l].x - 255), (int)(vecLights[l].y - 255), vecLights[l].colour, simd == 1);
+		});
+	olc::Sprite sprDst(nScreenWidth, nScreenHeight);
+	measure("Tone map SIMD", 1, 0.0, none, [&] { accum.ToneMap(sprDst.GetData(), true); });
+	measure("Tone map scalar", 1, 0.0, none, [&] { accum.ToneMap(sprDst.GetData(), false); });
 
-			// Draw each triangle in fan
-			for (int i = 0; i < vecVisibilityPolygonPoints.size() - 1; i++)
-			{
-				FillTriangle(
-					fSourceX,
-					fSourceY,
+	// Tiles seen from each light's tile: shadowcasting on the grid, against
+	// filling the sweep's polygon into a mask with one pixel per tile
+	int nTileRadius = (int)(fRadius / sc.fBlockWidth);
+	vector<sTileVisibility> vecTileVis(nLights), vecPolygonVis(nLights);
+	measure("Tile FOV shadowcasting", nLights, 0.0, none, [&]
+	{
+		for (int l = 0; l < nLights; l++)
+			sc.CalculateTileVisibility((int)(vecLights[l].x / sc.fBlockWidth), (int)(vecLights[l].y / sc.fBlockWidth), nTileRadius, vecTileVis[l]);
+	});
 
-					get<1>(vecVisibilityPolygonPoints[i]),
-					get<2>(vecVisibilityPolygonPoints[i]),
+	// Every light adding what it sees to the tiles explored
+	sTileVisibility explored;
+	measure("Fog of war explore", nLights, 0.0, [&] { explored.Resize(nWidth, nHeight); }, [&]
+	{
+		for (int l = 0; l < nLights; l++)
+			sc.CalculateTileVisibility((int)(vecLights[l].x / sc.fBlockWidth), (int)(vecLights[l].y / sc.fBlockWidth), nTileRadius, explored, true);
+	});
 
-					get<1>(vecVisibilityPolygonPoints[i + 1]),
-					get<2>(vecVisibilityPolygonPoints[i + 1]));
+	sLightMask tileMask;
+	tileMask.Resize(nWidth, nHeight);
+	vector<tuple<float, float, float>> vecTilePolygon;
+	measure("Tile FOV from polygon", nLights, 0.0, none, [&]
+	{
+		for (int l = 0; l < nLights; l++)
+		{
+			sc.CalculateVisibilityPolygons(&vecLights[l], 1, &vecTilePolygon);
+			ShadowCasting::RemoveDuplicatePoints(vecTilePolygon);
+			for (auto &point : vecTilePolygon)
+				point = { get<0>(point), get<1>(point) / sc.fBlockWidth, get<2>(point) / sc.fBlockWidth };
 
-			}
+			tileMask.Clear();
+			tileMask.FillFan(vecLights[l].x / sc.fBlockWidth, vecLights[l].y / sc.fBlockWidth, vecTilePolygon);
+			vecPolygonVis[l].Resize(nWidth, nHeight);
+			for (int y = tileMask.dirtyTop; y < tileMask.dirtyBottom; y++)
+				for (int x = 0; x < nWidth; x++)
+					if (tileMask.coverage[y * nWidth + x])
+						vecPolygonVis[l].Set(x, y);
+		}
+	});
 
-			// Fan will have one open edge, so draw last point of fan to first
-			FillTriangle(
-				fSourceX,
-				fSourceY,
+	// The grid counts a block as in the way only across the middle of its
+	// row, the polygon across its whole square, so some floor tiles near
+	// shadow edges differ. Count how many, well inside the radius.
+	long nFloor = 0, nDiffer = 0;
+	for (int l = 0; l < nLights; l++)
+	{
+		int lx = (int)(vecLights[l].x / sc.fBlockWidth), ly = (int)(vecLights[l].y / sc.fBlockWidth);
+		for (int y = 0; y < nHeight; y++)
+			for (int x = 0; x < nWidth; x++)
+				if (!sc.world[y * nWidth + x].exist && (x - lx) * (x - lx) + (y - ly) * (y - ly) < nTileRadius * nTileRadius * 3 / 4)
+				{
+					nFloor++;
+					nDiffer += vecTileVis[l].Get(x, y) != vecPolygonVis[l].Get(x, y);
+				}
+	}
+	printf("%-28s %13.2f%%\n", "Tile FOV disagreement", nFloor ? 100.0 * nDiffer / nFloor : 0.0);
+
+	// Agents in empty cells looking at others up to a light radius away, as
+	// one batch, with one thread and with all of them. The rays/s column is
+	// segments tested per second.
+	const int nSightLines = 65536;
+	vector<sSightLine> vecSightLines;
+	while ((int)vecSightLines.size() < nSightLines)
+	{
+		auto &a = vecEmpty[rng() % vecEmpty.size()], &b = vecEmpty[rng() % vecEmpty.size()];
+		sSightLine line = { (a.first + 0.5f) * sc.fBlockWidth, (a.second + 0.5f) * sc.fBlockWidth, (b.first + 0.5f) * sc.fBlockWidth, (b.second + 0.5f) * sc.fBlockWidth };
+		if (hypotf(line.bx - line.ax, line.by - line.ay) <= fRadius)
+			vecSightLines.push_back(line);
+	}
+	vector<uint64_t> vecSight;
+	vector<int> vecThreadCounts = { 1 };
+	if (thread::hardware_concurrency() > 1)
+		vecThreadCounts.push_back((int)thread::hardware_concurrency());
+	for (int nThreads : vecThreadCounts)
+	{
+		sc.SetVisibilityThreads(nThreads);
+		measure("Line of sight " + to_string(nThreads) + (nThreads == 1 ? " thread" : " threads"), nSightLines, nSightLines, none,
+			[&] { sc.HasLineOfSight(vecSightLines.data(), nSightLines, vecSight); });
+	}
+	sc.SetVisibilityThreads(1);
 
-				get<1>(vecVisibilityPolygonPoints[vecVisibilityPolygonPoints.size() - 1]),
-				get<2>(vecVisibilityPolygonPoints[vecVisibilityPolygonPoints.size() - 1]),
+	return 0;
+}
 
-				get<1>(vecVisibilityPolygonPoints[0]),
-				get<2>(vecVisibilityPolygonPoints[0]));
+#if defined(OLC_PLATFORM_HEADLESS)
+/*
+Headless run, for builds with OLC_PLATFORM_HEADLESS defined. Plays a
+scripted session through the engine without a window. The mouse light
+circles the map, a light is placed every second for the first 8 seconds,
+and a block is clicked every 15 frames. Prints the frame rate at the end.
+	--frames N         frames to run (600)
+	--dump file        write the last frame out as a PPM image
+	--profile prefix   write the stage timings to prefix.csv and prefix.json,
+	                   failing if the start times read back out of order
+*/
+int RunHeadless(int argc, char *argv[]) {
+	int nFrames = 600;
+	string sDumpFile, sProfilePrefix;
 
-			// Wherever rays exist in ray sprite, copy over radial light sprite pixels
-			SetDrawTarget(nullptr);
-			for (int x = 0; x < ScreenWidth(); x++)
-				for (int y = 0; y < ScreenHeight(); y++)
-					if (buffLightRay->GetPixel(x, y).r > 0)
-						Draw(x, y, buffLightTex->GetPixel(x, y));
+	for (int a = 1; a < argc; a++)
+	{
+		string arg = argv[a];
+		bool bValue = a + 1 < argc;
+		if (arg == "--frames" && bValue) nFrames = max(1, atoi(argv[++a]));
+		else if (arg == "--dump" && bValue) sDumpFile = argv[++a];
+		else if (arg == "--profile" && bValue) sProfilePrefix = argv[++a];
+		else
+		{
+			cerr << "usage: " << argv[0] << " [--frames N] [--dump file.ppm] [--profile prefix]\n"
+				<< "       " << argv[0] << " --bench [options]\n";
+			return 1;
 		}
+	}
 
+	ShadowCasting demo;
+	if (!demo.Construct(640, 480, 1, 1))
+		return 1;
 
+	// The blocks clicked on, away from the boundary
+	int nClickX = 0, nClickY = 0;
+	uint32_t nRandom = 12345;
 
-		// Draw Blocks from TileMap
-		for (int x = 0; x < nWorldWidth; x++)
-			for (int y = 0; y < nWorldHeight; y++)
-			{
-				if (world[y * nWorldWidth + x].exist)
-					if (world[y * nWorldWidth + x].boundary) {
-						FillRect(x * fBlockWidth, y * fBlockWidth, fBlockWidth, fBlockWidth, olc::DARK_RED);
-					}
-					else {
-						FillRect(x *fBlockWidth, y *fBlockWidth, fBlockWidth, fBlockWidth, olc::BLUE);
-					}
+	olc::headlessScript.funcInput = [&](olc::PixelGameEngine *pge, uint32_t nFrame)
+	{
+		if ((int)nFrame >= nFrames)
+			return false;
 
-			}
+		// Light follows the mouse the whole time
+		pge->olc_UpdateMouseState(1, true);
 
-		// Draw Edges from PolyMap
-		if (GetKey(olc::Key::D).bHeld) {
-			debugMode = true;
+		// Pressed for one frame, so GetKey sees one press, and away from the
+		// click frames so the light goes where the mouse light is, not on the
+		// block just clicked
+		pge->olc_UpdateKeyState(olc::Key::L, nFrame % 60 == 37 && nFrame < 8 * 60);
 
+		// Click a block: press on one frame, release on the next
+		if (nFrame % 15 == 0)
+		{
+			nRandom = nRandom * 1103515245 + 12345;
+			nClickX = 3 + (nRandom >> 16) % (demo.nWorldWidth - 6);
+			nRandom = nRandom * 1103515245 + 12345;
+			nClickY = 3 + (nRandom >> 16) % (demo.nWorldHeight - 6);
+		}
+		if (nFrame % 15 < 2)
+		{
+			pge->olc_UpdateMouse((int)((nClickX + 0.5f) * demo.fBlockWidth), (int)((nClickY + 0.5f) * demo.fBlockWidth));
+			pge->olc_UpdateMouseState(0, nFrame % 15 == 0);
+		}
+		else
+		{
+			float fAngle = nFrame * 0.02f;
+			pge->olc_UpdateMouse((int)(320 + 200 * cosf(fAngle)), (int)(240 + 150 * sinf(fAngle)));
 		}
+		return true;
+	};
 
+	olc::headlessScript.funcFrame = [&](olc::Sprite *frame, uint32_t nFrame)
+	{
+		if ((int)nFrame != nFrames - 1 || sDumpFile.empty())
+			return;
 
-		if (debugMode) {
-			for (auto &edge : vecEdges)
-			{
-				DrawLine(edge.startX, edge.startY, edge.endX, edge.endY);
-				FillCircle(edge.startX, edge.startY, 3, olc::BLUE);
-				FillCircle(edge.endX, edge.endY, 3, olc::BLUE);
-			}
+		ofstream file(sDumpFile, ios::binary);
+		file << "P6\n" << frame->width << " " << frame->height << "\n255\n";
+		for (int i = 0; i < frame->width * frame->height; i++)
+		{
+			const olc::Pixel &p = frame->GetData()[i];
+			file.put((char)p.r).put((char)p.g).put((char)p.b);
 		}
+	};
 
-		return true;
-    }
-};
+	auto tStart = chrono::steady_clock::now();
+	demo.Start();
+	double fSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+
+	printf("%d frames in %.3f s, %.1f fps\n", nFrames, fSeconds, nFrames / fSeconds);
+
+	if (!sProfilePrefix.empty())
+	{
+		printf("\n%-12s %10s %10s %10s\n", "stage (us)", "min", "avg", "p99");
+		for (int s = 0; s < PROF_STAGE_COUNT; s++)
+		{
+			FrameProfiler::sStats stats = demo.profiler.Stats((ProfileStage)s);
+			printf("%-12s %10.1f %10.1f %10.1f\n", ProfileStageNames[s], stats.min, stats.avg, stats.p99);
+		}
+		if (!demo.DumpProfile(sProfilePrefix))
+		{
+			cerr << "Can't write " << sProfilePrefix << ".csv/.json\n";
+			return 1;
+		}
+		if (!demo.profiler.CheckCsvOrder(sProfilePrefix + ".csv"))
+		{
+			cerr << "Stage start times out of order in " << sProfilePrefix << ".csv\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
 
-int main()
+int main(int argc, char *argv[])
 {
+	if (argc > 1 && string(argv[1]) == "--bench")
+		return RunBenchmark(argc, argv);
+
+#if defined(OLC_PLATFORM_HEADLESS)
+	return RunHeadless(argc, argv);
+#else
     ShadowCasting demo;
     if (demo.Construct(640, 480, 2, 2))
         demo.Start();
+#endif
 }
@@ -119,6 +119,18 @@
 	Before including the olcPixelGameEngine.h header file. stb_image.h works on many systems
 	and can be downloaded here: https://github.com/nothings/stb/blob/master/stb_image.h
 
+	Running Headless
+	~~~~~~~~~~~~~~~~
+	For batch jobs and tests on machines without a display, the window and
+	OpenGL can be swapped for a null platform and a software renderer:
+
+	#define OLC_PLATFORM_HEADLESS
+
+	Before including the olcPixelGameEngine.h header file, and leave out -lX11 -lGL.
+	Start() then runs the frames back to back with no window. Input is fed in by the
+	olc::headlessScript callbacks, which also get each finished frame. Decals are not
+	drawn by the software renderer.
+
 	Ports
 	~~~~~
 	olc::PixelGameEngine has been ported and tested with varying degrees of
@@ -278,7 +290,7 @@ int main()
 	#endif
 #endif
 
-#if defined(__APPLE__)
+#if defined(__APPLE__) && !defined(OLC_PLATFORM_HEADLESS)
 	#define PGE_USE_CUSTOM_START
 #endif
 
@@ -301,7 +313,7 @@ int main()
 
 #define UNUSED(x) (void)(x)
 
-#if !defined(OLC_GFX_OPENGL33) && !defined(OLC_GFX_DIRECTX10)
+#if !defined(OLC_GFX_OPENGL33) && !defined(OLC_GFX_DIRECTX10) && !defined(OLC_PLATFORM_HEADLESS)
 	#define OLC_GFX_OPENGL10
 #endif
 
@@ -652,6 +664,21 @@ namespace olc
 	static std::unique_ptr<Platform> platform;
 	static std::map<size_t, uint8_t> mapKeys;
 
+#if defined(OLC_PLATFORM_HEADLESS)
+	// Stands in for the user and the screen when running headless
+	struct HeadlessScript
+	{
+		// Called before frame nFrame is updated, to feed it input through the
+		// olc_Update... "Break In" functions. Return false to end the run.
+		std::function<bool(olc::PixelGameEngine* pge, uint32_t nFrame)> funcInput = nullptr;
+		// Called once frame nFrame has been drawn, with the final image
+		std::function<void(olc::Sprite* frame, uint32_t nFrame)> funcFrame = nullptr;
+		// The frame being run, counting from 0
+		uint32_t nFrame = 0;
+	};
+	extern HeadlessScript headlessScript;
+#endif
+
 	// O------------------------------------------------------------------------------O
 	// | olc::PixelGameEngine - The main BASE class for your application              |
 	// O------------------------------------------------------------------------------O
@@ -2700,6 +2727,9 @@ namespace olc
 	olc::PixelGameEngine* olc::Platform::ptrPGE = nullptr;
 	olc::PixelGameEngine* olc::Renderer::ptrPGE = nullptr;
 	std::unique_ptr<ImageLoader> olc::Sprite::loader = nullptr;
+#if defined(OLC_PLATFORM_HEADLESS)
+	HeadlessScript headlessScript;
+#endif
 };
 
 
@@ -3297,10 +3327,242 @@ namespace olc
 // O------------------------------------------------------------------------------O
 
 
+// O------------------------------------------------------------------------------O
+// | START RENDERER: Software, for headless runs                                  |
+// O------------------------------------------------------------------------------O
+#if defined(OLC_PLATFORM_HEADLESS)
+namespace olc
+{
+	class Renderer_Headless : public olc::Renderer
+	{
+	private:
+		// Textures are plain copies of the sprites uploaded to them
+		std::vector<std::unique_ptr<olc::Sprite>> vTextures;
+		uint32_t nActiveTexture = 0;
+		std::unique_ptr<olc::Sprite> sprFrame = std::make_unique<olc::Sprite>(0, 0);
+
+	public:
+		void PrepareDevice() override
+		{}
+
+		olc::rcode CreateDevice(std::vector<void*> params, bool bFullScreen, bool bVSYNC) override
+		{
+			UNUSED(params);
+			UNUSED(bFullScreen);
+			UNUSED(bVSYNC);
+			return olc::rcode::OK;
+		}
+
+		olc::rcode DestroyDevice() override
+		{
+			vTextures.clear();
+			return olc::rcode::OK;
+		}
+
+		void DisplayFrame() override
+		{
+			if (headlessScript.funcFrame)
+				headlessScript.funcFrame(sprFrame.get(), headlessScript.nFrame);
+			headlessScript.nFrame++;
+		}
+
+		void PrepareDrawing() override
+		{}
+
+		void DrawLayerQuad(const olc::vf2d& offset, const olc::vf2d& scale, const olc::Pixel tint) override
+		{
+			if (nActiveTexture >= vTextures.size() || !vTextures[nActiveTexture]) return;
+			olc::Sprite* tex = vTextures[nActiveTexture].get();
+			if (tex->width == 0 || tex->height == 0) return;
+
+			// Same mapping as the OpenGL quad, sampled at pixel centres
+			olc::Sprite& frame = *sprFrame;
+			bool bPlain = offset.x == 0.0f && offset.y == 0.0f && scale.x == 1.0f && scale.y == 1.0f &&
+				tint == olc::WHITE && tex->width == frame.width && tex->height == frame.height;
+			for (int32_t y = 0; y < frame.height; y++)
+			{
+				olc::Pixel* dst = frame.GetData() + y * frame.width;
+				if (bPlain)
+				{
+					// The usual case, one layer straight over the screen
+					const olc::Pixel* src = tex->GetData() + y * tex->width;
+					for (int32_t x = 0; x < frame.width; x++)
+						if (src[x].a == 255) dst[x] = src[x];
+						else if (src[x].a > 0) dst[x] = Blend(dst[x], src[x]);
+					continue;
+				}
+
+				float v = ((y + 0.5f) / frame.height) * scale.y + offset.y;
+				int32_t ty = int32_t(v * tex->height);
+				if (v < 0.0f || ty >= tex->height) continue;
+				for (int32_t x = 0; x < frame.width; x++)
+				{
+					float u = ((x + 0.5f) / frame.width) * scale.x + offset.x;
+					int32_t tx = int32_t(u * tex->width);
+					if (u < 0.0f || tx >= tex->width) continue;
+					const olc::Pixel& t = tex->GetData()[ty * tex->width + tx];
+					dst[x] = Blend(dst[x], olc::Pixel(t.r * tint.r / 255, t.g * tint.g / 255, t.b * tint.b / 255, t.a * tint.a / 255));
+				}
+			}
+		}
+
+		void DrawDecalQuad(const olc::DecalInstance& decal) override
+		{
+			UNUSED(decal);
+		}
+
+		uint32_t CreateTexture(const uint32_t width, const uint32_t height) override
+		{
+			for (uint32_t id = 0; id < vTextures.size(); id++)
+				if (!vTextures[id])
+				{
+					vTextures[id] = std::make_unique<olc::Sprite>(width, height);
+					return id;
+				}
+			vTextures.push_back(std::make_unique<olc::Sprite>(width, height));
+			return uint32_t(vTextures.size() - 1);
+		}
+
+		uint32_t DeleteTexture(const uint32_t id) override
+		{
+			if (id < vTextures.size()) vTextures[id].reset();
+			return id;
+		}
+
+		void UpdateTexture(uint32_t id, olc::Sprite* spr) override
+		{
+			if (id >= vTextures.size() || !vTextures[id] || spr == nullptr) return;
+			olc::Sprite* tex = vTextures[id].get();
+			if (tex->width != spr->width || tex->height != spr->height)
+				vTextures[id] = std::make_unique<olc::Sprite>(spr->width, spr->height), tex = vTextures[id].get();
+			std::copy(spr->GetData(), spr->GetData() + spr->width * spr->height, tex->GetData());
+		}
+
+		void ApplyTexture(uint32_t id) override
+		{
+			nActiveTexture = id;
+		}
+
+		void ClearBuffer(olc::Pixel p, bool bDepth) override
+		{
+			UNUSED(bDepth);
+			if (sprFrame->width != ptrPGE->ScreenWidth() || sprFrame->height != ptrPGE->ScreenHeight())
+				sprFrame = std::make_unique<olc::Sprite>(ptrPGE->ScreenWidth(), ptrPGE->ScreenHeight());
+			std::fill(sprFrame->GetData(), sprFrame->GetData() + sprFrame->width * sprFrame->height, p);
+		}
+
+		void UpdateViewport(const olc::vi2d& pos, const olc::vi2d& size) override
+		{
+			UNUSED(pos);
+			UNUSED(size);
+		}
+
+	private:
+		// Alpha blend src over dst, as the OpenGL renderer does
+		static olc::Pixel Blend(const olc::Pixel& dst, const olc::Pixel& src)
+		{
+			float a = src.a / 255.0f;
+			return olc::Pixel(
+				uint8_t(src.r * a + dst.r * (1.0f - a)),
+				uint8_t(src.g * a + dst.g * (1.0f - a)),
+				uint8_t(src.b * a + dst.b * (1.0f - a)),
+				255);
+		}
+	};
+}
+#endif
+// O------------------------------------------------------------------------------O
+// | END RENDERER: Software, for headless runs                                    |
+// O------------------------------------------------------------------------------O
+
+
+
+// O------------------------------------------------------------------------------O
+// | START PLATFORM: HEADLESS                                                     |
+// O------------------------------------------------------------------------------O
+#if defined(OLC_PLATFORM_HEADLESS)
+namespace olc
+{
+	class Platform_Headless : public olc::Platform
+	{
+	public:
+		virtual olc::rcode ApplicationStartUp() override
+		{
+			headlessScript.nFrame = 0;
+			return olc::rcode::OK;
+		}
+
+		virtual olc::rcode ApplicationCleanUp() override
+		{
+			return olc::rcode::OK;
+		}
+
+		virtual olc::rcode ThreadStartUp() override
+		{
+			return olc::rcode::OK;
+		}
+
+		virtual olc::rcode ThreadCleanUp() override
+		{
+			renderer->DestroyDevice();
+			return olc::OK;
+		}
+
+		virtual olc::rcode CreateGraphics(bool bFullScreen, bool bEnableVSYNC, const olc::vi2d& vViewPos, const olc::vi2d& vViewSize) override
+		{
+			if (renderer->CreateDevice({}, bFullScreen, bEnableVSYNC) == olc::rcode::OK)
+			{
+				renderer->UpdateViewport(vViewPos, vViewSize);
+				return olc::rcode::OK;
+			}
+			else
+				return olc::rcode::FAIL;
+		}
+
+		virtual olc::rcode CreateWindowPane(const olc::vi2d& vWindowPos, olc::vi2d& vWindowSize, bool bFullScreen) override
+		{
+			UNUSED(vWindowPos);
+			UNUSED(vWindowSize);
+			UNUSED(bFullScreen);
+
+			// There is no window, but act as if it has both kinds of focus
+			ptrPGE->olc_UpdateKeyFocus(true);
+			ptrPGE->olc_UpdateMouseFocus(true);
+			return olc::OK;
+		}
+
+		virtual olc::rcode SetWindowTitle(const std::string& s) override
+		{
+			UNUSED(s);
+			return olc::OK;
+		}
+
+		virtual olc::rcode StartSystemEventLoop() override
+		{
+			return olc::OK;
+		}
+
+		virtual olc::rcode HandleSystemEvent() override
+		{
+			// Called at the start of every frame, before the input is scanned.
+			// Without a script the run lasts until OnUserUpdate returns false.
+			if (headlessScript.funcInput && !headlessScript.funcInput(ptrPGE, headlessScript.nFrame))
+				ptrPGE->olc_Terminate();
+			return olc::OK;
+		}
+	};
+}
+#endif
+// O------------------------------------------------------------------------------O
+// | END PLATFORM: HEADLESS                                                       |
+// O------------------------------------------------------------------------------O
+
+
+
 // O------------------------------------------------------------------------------O
 // | START PLATFORM: MICROSOFT WINDOWS XP, VISTA, 7, 8, 10                        |
 // O------------------------------------------------------------------------------O
-#if defined(_WIN32)
+#if defined(_WIN32) && !defined(OLC_PLATFORM_HEADLESS)
 #if !defined(__MINGW32__)
 #pragma comment(lib, "user32.lib")		// Visual Studio Only
 #pragma comment(lib, "gdi32.lib")		// For other Windows Compilers please add
@@ -3514,7 +3776,7 @@ namespace olc
 // O------------------------------------------------------------------------------O
 // | START PLATFORM: LINUX                                                        |
 // O------------------------------------------------------------------------------O
-#if defined(__linux__) || defined(__FreeBSD__)
+#if (defined(__linux__) || defined(__FreeBSD__)) && !defined(OLC_PLATFORM_HEADLESS)
 namespace olc
 {
 	class Platform_Linux : public olc::Platform
@@ -3749,7 +4011,7 @@ namespace olc
 // and support on how to setup your build environment.
 //
 // "MASSIVE MASSIVE THANKS TO MUMFLR" - Javidx9
-#if defined(__APPLE__)
+#if defined(__APPLE__) && !defined(OLC_PLATFORM_HEADLESS)
 namespace olc {
 
 	class Platform_GLUT : public olc::Platform
@@ -4017,6 +4279,11 @@ namespace olc
 
 
 
+#if defined(OLC_PLATFORM_HEADLESS)
+		platform = std::make_unique<olc::Platform_Headless>();
+		renderer = std::make_unique<olc::Renderer_Headless>();
+#else
+
 #if defined(_WIN32)
 		platform = std::make_unique<olc::Platform_Windows>();
 #endif
@@ -4029,6 +4296,8 @@ namespace olc
 		platform = std::make_unique<olc::Platform_GLUT>();
 #endif
 
+#endif
+
 
 
 #if defined(OLC_GFX_OPENGL10)